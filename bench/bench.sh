@@ -0,0 +1,65 @@
+#!/bin/sh
+# Benchmark tiffsnip on synthetic files, printing one JSON object per
+# operation. Each file is generated, listed, has its middle page deleted
+# and is then verified, when this tiffsnip has --verify.
+#
+# Settings come from the environment:
+#   BENCH_DIR      where the generated files go (default: /tmp)
+#   BENCH_SIZES    tile data per file (default: 256M 3G)
+#   BENCH_TILES    tiles or strips per page (default: 1 1000 100000)
+#   BENCH_FORMATS  classic and/or big (default: both)
+#   BENCH_LAYOUTS  tiles and/or strips (default: both)
+#   BENCH_PLACES   contiguous and/or scattered (default: both)
+#   BENCH_ARGS     extra tiffsnip options for the delete, such as --punch
+
+cd "$(dirname "$0")/.." || exit 1
+TIFFSNIP=${TIFFSNIP:-./tiffsnip}
+BENCH_DIR=${BENCH_DIR:-/tmp}
+BENCH_SIZES=${BENCH_SIZES:-"256M 3G"}
+BENCH_TILES=${BENCH_TILES:-"1 1000 100000"}
+BENCH_FORMATS=${BENCH_FORMATS:-"classic big"}
+BENCH_LAYOUTS=${BENCH_LAYOUTS:-"tiles strips"}
+BENCH_PLACES=${BENCH_PLACES:-"contiguous scattered"}
+
+file="$BENCH_DIR/tiffsnip-bench-$$.tif"
+trap 'rm -f "$file"' EXIT INT TERM
+verify=false
+"$TIFFSNIP" --help | grep -q -- --verify && verify=true
+
+json_number(){
+    # pull a numeric field out of gentiff's one line of JSON
+    sed -n "s/.*\"$1\":\([0-9]*\).*/\1/p"
+}
+
+for size in $BENCH_SIZES; do
+for format in $BENCH_FORMATS; do
+for layout in $BENCH_LAYOUTS; do
+for tiles in $BENCH_TILES; do
+for place in $BENCH_PLACES; do
+    # a single tile can't be scattered
+    [ "$tiles" = 1 ] && [ "$place" = scattered ] && continue
+    flags="--size $size --tiles $tiles"
+    [ "$format" = big ] && flags="$flags --big"
+    [ "$layout" = strips ] && flags="$flags --strips"
+    [ "$place" = scattered ] && flags="$flags --scatter"
+    description=$(bench/gentiff $flags "$file" 2>&1)
+    if [ $? -ne 0 ]; then
+        printf '{"size":"%s","format":"%s","layout":"%s","tiles":"%s","placement":"%s","skipped":"%s"}\n' \
+               "$size" "$format" "$layout" "$tiles" "$place" "$description"
+        continue
+    fi
+    bytes=$(echo "$description" | json_number bytes)
+    page_bytes=$(echo "$description" | json_number page_bytes)
+    tags="-t size=$size -t format=$format -t layout=$layout -t tiles=$tiles -t placement=$place"
+
+    bench/measure $tags -t op=list -b "$bytes" "$TIFFSNIP" --list "$file"
+    bench/measure $tags -t op=delete -b "$page_bytes" "$TIFFSNIP" $BENCH_ARGS "$file" 2
+    if $verify; then
+        bench/measure $tags -t op=verify -b "$bytes" "$TIFFSNIP" --verify "$file"
+    fi
+    rm -f "$file"
+done
+done
+done
+done
+done
@@ -0,0 +1,311 @@
+/*
+ * Generate a synthetic multi-page tiff for benchmarking tiffsnip.
+ *
+ * Every page gets the same number of tiles or strips filled with a byte
+ * unique to the page, followed by its offset and bytecount arrays, a
+ * description and its IFD. Tiles are either laid out page after page or
+ * interleaved between pages, so deleting one page leaves scattered holes.
+ * A JSON description of the file is printed when it is written.
+ */
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <getopt.h>
+#include "../tiff.h"
+
+#define BUFFER_SIZE (1024 * 1024)
+
+struct Layout {
+    bool big_tiff;
+    bool strips;
+    bool scatter;
+    int pages;
+    uint64_t tiles;
+    uint64_t size;
+    uint64_t tile_size;
+    // the grid of 256x256 tiles, or 256 row strips, the image is cut into
+    uint64_t across;
+    uint64_t down;
+};
+
+struct Row {
+    uint16 tag;
+    uint16 tag_type;
+    uint64_t count;
+    uint64_t value;
+};
+
+bool parse_size(const char *text, uint64_t *size){
+    char *end;
+    unsigned long long value = strtoull(text, &end, 10);
+    if(end == text){
+        return false;
+    }
+    switch(*end){
+        case 'k':
+        case 'K':
+            value <<= 10;
+            end++;
+            break;
+        case 'm':
+        case 'M':
+            value <<= 20;
+            end++;
+            break;
+        case 'g':
+        case 'G':
+            value <<= 30;
+            end++;
+            break;
+    }
+    *size = value;
+    return *end == '\0' && value > 0;
+}
+
+int page_fill(int page){
+    return (page * 37 + 11) % 255 + 1;
+}
+
+/*
+ * Offset of a tile's data. Contiguous files hold each page's tiles in one
+ * run, scattered ones hold tile t of every page before tile t + 1.
+ */
+uint64_t tile_offset(struct Layout *layout, uint64_t data_start, int page, uint64_t tile){
+    uint64_t index;
+    if(layout->scatter){
+        index = tile * layout->pages + page;
+    } else {
+        index = page * layout->tiles + tile;
+    }
+    return data_start + index * layout->tile_size;
+}
+
+bool write_fill(FILE *fp, int fill, uint64_t size){
+    static char buffer[BUFFER_SIZE];
+    static int buffer_fill = -1;
+    if(buffer_fill != fill){
+        memset(buffer, fill, sizeof(buffer));
+        buffer_fill = fill;
+    }
+    while(size > 0){
+        size_t chunk = size > BUFFER_SIZE ? BUFFER_SIZE : size;
+        if(fwrite(buffer, 1, chunk, fp) != chunk){
+            return false;
+        }
+        size -= chunk;
+    }
+    return true;
+}
+
+bool write_value(FILE *fp, uint64_t value, int width){
+    // little endian whatever the host
+    uint8 bytes[8];
+    for(int i = 0; i < width; i++){
+        bytes[i] = value >> (8 * i);
+    }
+    return fwrite(bytes, 1, width, fp) == (size_t)width;
+}
+
+bool write_array(FILE *fp, struct Layout *layout, uint64_t data_start, int page, bool sizes){
+    int width = layout->big_tiff ? 8 : 4;
+    for(uint64_t t = 0; t < layout->tiles; t++){
+        uint64_t value = sizes ? layout->tile_size : tile_offset(layout, data_start, page, t);
+        if(!write_value(fp, value, width)){
+            return false;
+        }
+    }
+    return true;
+}
+
+int generate(const char *path, struct Layout *layout){
+    FILE *fp = fopen(path, "wb");
+    if(fp == NULL){
+        perror(path);
+        return 1;
+    }
+    setvbuf(fp, NULL, _IOFBF, BUFFER_SIZE);
+    int offset_size = layout->big_tiff ? 8 : 4;
+    uint64_t header_size = layout->big_tiff ? 16 : 8;
+    uint64_t data_start = header_size;
+    uint64_t data_size = layout->tile_size * layout->tiles * layout->pages;
+    uint64_t array_size = layout->tiles * offset_size;
+    // per page: two arrays, a description and the IFD
+    uint64_t page_meta = 2 * (layout->tiles > 1 ? array_size : 0) + 64 + 8 + 20 * 16 + 8;
+    if(!layout->big_tiff && data_start + data_size + layout->pages * page_meta > UINT32_MAX){
+        fprintf(stderr, "%s: too large for a classic tiff, use --big\n", path);
+        fclose(fp);
+        return 1;
+    }
+
+    // header, pointing at the first IFD once we know where it is
+    bool ok = fwrite("II", 1, 2, fp) == 2;
+    if(layout->big_tiff){
+        ok = ok && write_value(fp, TIFF_VERSION_BIG, 2) && write_value(fp, 8, 2) && write_value(fp, 0, 2);
+    } else {
+        ok = ok && write_value(fp, TIFF_VERSION_CLASSIC, 2);
+    }
+    ok = ok && write_value(fp, 0, offset_size);
+
+    // tile data
+    if(layout->scatter){
+        for(uint64_t t = 0; ok && t < layout->tiles; t++){
+            for(int p = 0; ok && p < layout->pages; p++){
+                ok = write_fill(fp, page_fill(p), layout->tile_size);
+            }
+        }
+    } else {
+        for(int p = 0; ok && p < layout->pages; p++){
+            ok = write_fill(fp, page_fill(p), layout->tile_size * layout->tiles);
+        }
+    }
+
+    // arrays, description and IFD of each page, chained in order
+    uint64_t cursor = data_start + data_size;
+    uint64_t link = header_size - offset_size;
+    for(int p = 0; ok && p < layout->pages; p++){
+        uint64_t offsets_at = cursor;
+        uint64_t sizes_at = cursor;
+        if(layout->tiles > 1){
+            ok = write_array(fp, layout, data_start, p, false) && write_array(fp, layout, data_start, p, true);
+            sizes_at = cursor + array_size;
+            cursor += 2 * array_size;
+        }
+        char description[64];
+        memset(description, 0, sizeof(description));
+        snprintf(description, sizeof(description), "Synthetic page %d", p + 1);
+        uint64_t description_at = cursor;
+        ok = ok && fwrite(description, 1, sizeof(description), fp) == sizeof(description);
+        cursor += sizeof(description);
+
+        uint16 offset_type = layout->big_tiff ? TIFF_LONG8 : TIFF_LONG;
+        uint64_t first_offset = tile_offset(layout, data_start, p, 0);
+        struct Row rows[12];
+        int row_count = 0;
+        rows[row_count++] = (struct Row){TIFFTAG_SUBFILETYPE, TIFF_LONG, 1, p > 0};
+        rows[row_count++] = (struct Row){TIFFTAG_IMAGEWIDTH, TIFF_LONG, 1, layout->across * 256};
+        rows[row_count++] = (struct Row){TIFFTAG_IMAGELENGTH, TIFF_LONG, 1, layout->down * 256};
+        rows[row_count++] = (struct Row){TIFFTAG_COMPRESSION, TIFF_SHORT, 1, COMPRESSION_JPEG};
+        rows[row_count++] = (struct Row){TIFFTAG_IMAGEDESCRIPTION, TIFF_ASCII, sizeof(description), description_at};
+        if(layout->strips){
+            rows[row_count++] = (struct Row){TIFFTAG_STRIPOFFSETS, offset_type, layout->tiles, layout->tiles > 1 ? offsets_at : first_offset};
+            rows[row_count++] = (struct Row){TIFFTAG_ROWSPERSTRIP, TIFF_LONG, 1, 256};
+            rows[row_count++] = (struct Row){TIFFTAG_STRIPBYTECOUNTS, offset_type, layout->tiles, layout->tiles > 1 ? sizes_at : layout->tile_size};
+        } else {
+            rows[row_count++] = (struct Row){TIFFTAG_TILEWIDTH, TIFF_SHORT, 1, 256};
+            rows[row_count++] = (struct Row){TIFFTAG_TILELENGTH, TIFF_SHORT, 1, 256};
+            rows[row_count++] = (struct Row){TIFFTAG_TILEOFFSETS, offset_type, layout->tiles, layout->tiles > 1 ? offsets_at : first_offset};
+            rows[row_count++] = (struct Row){TIFFTAG_TILEBYTECOUNTS, offset_type, layout->tiles, layout->tiles > 1 ? sizes_at : layout->tile_size};
+        }
+
+        uint64_t ifd_at = cursor;
+        int count_size = layout->big_tiff ? 8 : 2;
+        ok = ok && write_value(fp, row_count, count_size);
+        for(int i = 0; ok && i < row_count; i++){
+            ok = write_value(fp, rows[i].tag, 2) && write_value(fp, rows[i].tag_type, 2) &&
+                 write_value(fp, rows[i].count, offset_size) && write_value(fp, rows[i].value, offset_size);
+        }
+        uint64_t next_at = ifd_at + count_size + row_count * (4 + 2 * offset_size);
+        ok = ok && write_value(fp, 0, offset_size);
+        cursor = next_at + offset_size;
+
+        // point the previous link at this IFD
+        ok = ok && fflush(fp) == 0 && fseeko(fp, link, SEEK_SET) == 0 && write_value(fp, ifd_at, offset_size) &&
+             fseeko(fp, cursor, SEEK_SET) == 0;
+        link = next_at;
+    }
+    if(fclose(fp) != 0 || !ok){
+        fprintf(stderr, "%s: writing failed\n", path);
+        return 1;
+    }
+    printf("{\"file\":\"%s\",\"bigtiff\":%s,\"layout\":\"%s\",\"placement\":\"%s\",\"pages\":%d,"
+           "\"tiles\":%llu,\"tile_bytes\":%llu,\"page_bytes\":%llu,\"bytes\":%llu}\n",
+           path, layout->big_tiff ? "true" : "false", layout->strips ? "strips" : "tiles",
+           layout->scatter ? "scattered" : "contiguous", layout->pages,
+           (unsigned long long)layout->tiles, (unsigned long long)layout->tile_size,
+           (unsigned long long)(layout->tiles * layout->tile_size), (unsigned long long)cursor);
+    return 0;
+}
+
+void usage(){
+    printf("gentiff: write a synthetic tiff for benchmarking\n\n"
+           "Usage: gentiff [options] file\n\n"
+           "Options:\n"
+           "\t--big: write a BigTIFF\n"
+           "\t--strips: use strips instead of tiles\n"
+           "\t--scatter: interleave the tiles of every page instead of\n"
+           "\t           writing each page's tiles in one run\n"
+           "\t--pages n: number of pages (default: 3)\n"
+           "\t--tiles n: tiles or strips per page (default: 1000)\n"
+           "\t--size size: total tile data, such as 512M or 4G (default: 64M)\n"
+           "\t--help: show this message\n");
+}
+
+int main(int argc, char *argv[]){
+    struct Layout layout = {.pages = 3, .tiles = 1000, .size = 64 << 20};
+    static struct option long_options[] = {
+        {"help", no_argument, NULL, 'h'},
+        {"big", no_argument, NULL, 'b'},
+        {"strips", no_argument, NULL, 's'},
+        {"scatter", no_argument, NULL, 'S'},
+        {"pages", required_argument, NULL, 'p'},
+        {"tiles", required_argument, NULL, 't'},
+        {"size", required_argument, NULL, 'z'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while((opt = getopt_long(argc, argv, "h", long_options, NULL)) != -1){
+        switch(opt){
+            case 'b':
+                layout.big_tiff = true;
+                break;
+            case 's':
+                layout.strips = true;
+                break;
+            case 'S':
+                layout.scatter = true;
+                break;
+            case 'p':
+                layout.pages = atoi(optarg);
+                break;
+            case 't':
+                layout.tiles = strtoull(optarg, NULL, 10);
+                break;
+            case 'z':
+                if(!parse_size(optarg, &layout.size)){
+                    printf("Bad size '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'h':
+            default:
+                usage();
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if(optind != argc - 1 || layout.pages < 1 || layout.tiles < 1){
+        usage();
+        return 1;
+    }
+    // the image is as big as its tiles make it, as square as they divide
+    layout.across = 1;
+    for(uint64_t a = 2; !layout.strips && a * a <= layout.tiles; a++){
+        if(layout.tiles % a == 0){
+            layout.across = a;
+        }
+    }
+    layout.down = layout.tiles / layout.across;
+    if(layout.down * 256 > UINT32_MAX){
+        printf("%llu %s can't be laid out in an image under 4G pixels high\n",
+               (unsigned long long)layout.tiles, layout.strips ? "strips" : "tiles");
+        return 1;
+    }
+    layout.tile_size = layout.size / ((uint64_t)layout.pages * layout.tiles);
+    if(layout.tile_size == 0){
+        layout.tile_size = 1;
+    }
+    return generate(argv[optind], &layout);
+}
@@ -0,0 +1,4504 @@
+/*
+ * Copyright (c) 2019 Joseph Utecht
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#if defined(__has_include) && defined(__NR_io_uring_setup)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include "tiff.h"
+#include "libtiffsnip.h"
+
+static const bool DEBUG = false;
+
+#define BUFFER_SIZE (1024 * 1024)
+// offset and bytecount arrays are read this many elements at a time
+#define ARRAY_CHUNK 8192
+// reads without a mapping go through a cache of blocks starting this big,
+// which grow up to the maximum while reads run forward
+#define DEFAULT_READ_BLOCK (64 * 1024)
+#define MAX_READ_BLOCK TIFFSNIP_MAX_READ_BLOCK
+#define CACHE_BLOCKS 16
+// how much of a streamed input may be spooled while its IFDs are read
+#define DEFAULT_SPOOL_LIMIT (256 * 1024 * 1024)
+static const char ZEROS[BUFFER_SIZE] = {0};
+
+struct Header {
+    uint16 byte_order;
+    uint16 magic_number;
+};
+
+struct BigHeader {
+    uint16 offset_bytesize;
+    uint16 zeros;
+};
+
+struct __attribute__((__packed__)) IFD {
+    uint16 tag;
+    uint16 tag_type;
+    int32 count;
+    uint32 value;
+};
+
+struct __attribute__((__packed__)) BIGIFD {
+    uint16 tag;
+    uint16 tag_type;
+    uint64_t count;
+    uint64_t value;
+};
+
+struct TiffsnipRing;
+struct RangeList;
+
+/*
+ * File access goes through a TiffIO. When the file can be mapped every
+ * read is served straight out of the mapping and writes patch it in place,
+ * otherwise the buffered stdio path is used.
+ */
+struct CacheBlock {
+    off_t start;
+    int64_t size;
+    int64_t capacity;
+    uint8 *data;
+    uint64_t used;
+};
+
+struct BlockCache {
+    struct CacheBlock blocks[CACHE_BLOCKS];
+    size_t first_block;
+    size_t block_size;
+    // end of the last device read, to tell forward runs from jumps
+    off_t last_end;
+    uint64_t clock;
+    uint64_t device_reads;
+    uint64_t device_bytes;
+    uint64_t hits;
+    uint64_t hints;
+    size_t largest_block;
+};
+
+/*
+ * What --stats reports about a file: the wall time spent in each phase, the
+ * reads, writes and other calls made on it, how often the position jumped,
+ * and the ranges cleared, before and after coalescing and by size.
+ */
+enum Phase {
+    PHASE_OTHER,
+    PHASE_OPEN,
+    PHASE_WALK,
+    PHASE_GATHER,
+    PHASE_KEEP,
+    PHASE_JOURNAL,
+    PHASE_CLEAR,
+    PHASE_RELINK,
+    PHASE_COPY,
+    PHASE_VERIFY,
+    PHASE_COUNT
+};
+
+static const char *PHASE_NAMES[PHASE_COUNT] = {
+    "other", "open", "walk", "gather", "keep", "journal", "clear", "relink", "copy", "verify"
+};
+
+// range sizes are counted in power of two buckets
+#define SIZE_BUCKETS 64
+
+struct SnipStats {
+    enum Phase phase;
+    double since;
+    double started;
+    double seconds[PHASE_COUNT];
+    uint64_t read_bytes;
+    uint64_t read_calls;
+    uint64_t written_bytes;
+    uint64_t write_calls;
+    uint64_t other_calls;
+    uint64_t seeks;
+    // end of the last read or write, to tell jumps from runs
+    off_t last_end;
+    uint64_t ranges_gathered;
+    uint64_t ranges_coalesced;
+    uint64_t ranges_cleared;
+    uint64_t cleared_bytes;
+    uint64_t range_sizes[SIZE_BUCKETS];
+};
+
+struct TiffIO {
+    const char *path;
+    FILE *fp;
+    uint8 *map;
+    off_t size;
+    // layout of the file, classic unless the header says BigTIFF
+    int ifd_row_size;
+    int offset_size;
+    int ifd_count_size;
+    bool big_tiff;
+    // whether the file's byte order differs from the host's
+    bool swap;
+    // punch holes rather than writing zeros when clearing
+    bool punch;
+    // overwrite cleared ranges with this many random passes first, each
+    // made durable, and then with zeros only when final_zero is set
+    int random_passes;
+    bool final_zero;
+    // where notices go, if anywhere
+    FILE *log;
+    // clear gathered ranges early once this many are held, 0 for no limit
+    size_t range_limit;
+    // sorted ranges still referenced by surviving pages, never cleared
+    const struct RangeList *keep;
+    // when set, every range actually cleared is recorded here for --verify
+    struct RangeList *cleared;
+    // clearing and relinking writes are queued here when set
+    struct TiffsnipRing *ring;
+    // bytes are recorded here before they are overwritten, when set
+    struct Journal *journal;
+    // small reads are served from here when the file isn't mapped
+    struct BlockCache *cache;
+    // what the file cost is counted here for --stats, when set
+    struct SnipStats *stats;
+    // the file is a pipe being spooled to fp, when set
+    struct Stream *stream;
+    char error[256];
+};
+
+static double now_seconds(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void stats_start(struct SnipStats *stats){
+    memset(stats, 0, sizeof(struct SnipStats));
+    stats->started = stats->since = now_seconds();
+    stats->phase = PHASE_OPEN;
+    stats->last_end = -1;
+}
+
+/*
+ * Charge the time since the last switch to the phase being left and start
+ * timing phase, returning the one left so nested work can switch back.
+ */
+static enum Phase stats_phase(struct TiffIO *io, enum Phase phase){
+    struct SnipStats *stats = io->stats;
+    if(stats == NULL){
+        return PHASE_OTHER;
+    }
+    double now = now_seconds();
+    enum Phase previous = stats->phase;
+    stats->seconds[previous] += now - stats->since;
+    stats->since = now;
+    stats->phase = phase;
+    return previous;
+}
+
+/*
+ * Count size bytes moved at offset by calls system calls; those through the
+ * mapping take none. An offset of -1 is another file and never a seek.
+ */
+static void stats_read(struct TiffIO *io, off_t offset, int64_t size, int calls){
+    struct SnipStats *stats = io->stats;
+    if(stats == NULL){
+        return;
+    }
+    stats->read_bytes += size;
+    stats->read_calls += calls;
+    if(offset >= 0){
+        stats->seeks += offset != stats->last_end;
+        stats->last_end = offset + size;
+    }
+}
+
+static void stats_write(struct TiffIO *io, off_t offset, int64_t size, int calls){
+    struct SnipStats *stats = io->stats;
+    if(stats == NULL){
+        return;
+    }
+    stats->written_bytes += size;
+    stats->write_calls += calls;
+    if(offset >= 0){
+        stats->seeks += offset != stats->last_end;
+        stats->last_end = offset + size;
+    }
+}
+
+static void stats_call(struct TiffIO *io){
+    if(io->stats){
+        io->stats->other_calls += 1;
+    }
+}
+
+// checked like printf, so its arguments have to match the format
+static void io_error(struct TiffIO *io, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void io_error(struct TiffIO *io, const char *format, ...){
+    va_list args;
+    va_start(args, format);
+    vsnprintf(io->error, sizeof(io->error), format, args);
+    va_end(args);
+}
+
+static void io_set_layout(struct TiffIO *io, bool big_tiff){
+    io->big_tiff = big_tiff;
+    if(big_tiff){
+        io->ifd_row_size = sizeof(struct BIGIFD);
+        io->offset_size = sizeof(uint64_t);
+        io->ifd_count_size = sizeof(uint64_t);
+    } else {
+        io->ifd_row_size = sizeof(struct IFD);
+        io->offset_size = sizeof(uint32);
+        io->ifd_count_size = sizeof(int16);
+    }
+}
+
+/*
+ * Open path, mapping it when read_block is 0 and otherwise reading it
+ * through a cache of blocks starting at read_block bytes.
+ */
+static int io_open(struct TiffIO *io, const char *path, size_t read_block, bool writable){
+    memset(io, 0, sizeof(struct TiffIO));
+    io->path = path;
+    io_set_layout(io, false);
+    io->fp = fopen(path, writable ? "r+b" : "rb");
+    if(io->fp == NULL){
+        return 1;
+    }
+    struct stat st;
+    if(fstat(fileno(io->fp), &st) == 0){
+        io->size = st.st_size;
+    }
+    if(read_block == 0 && io->size > 0){
+        int protection = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+        void *map = mmap(NULL, io->size, protection, MAP_SHARED, fileno(io->fp), 0);
+        if(map != MAP_FAILED){
+            io->map = map;
+        } else if(DEBUG){
+            printf("mmap failed, falling back to stdio\n");
+        }
+    }
+    if(io->map == NULL){
+        io->cache = calloc(1, sizeof(struct BlockCache));
+        if(io->cache){
+            io->cache->first_block = read_block ? read_block : DEFAULT_READ_BLOCK;
+            io->cache->block_size = io->cache->first_block;
+            io->cache->last_end = -1;
+        }
+    }
+    return 0;
+}
+
+static int io_close(struct TiffIO *io){
+    if(io->map){
+        munmap(io->map, io->size);
+    }
+    if(io->cache){
+        for(int i = 0; i < CACHE_BLOCKS; i++){
+            free(io->cache->blocks[i].data);
+        }
+        free(io->cache);
+        io->cache = NULL;
+    }
+    return fclose(io->fp);
+}
+
+static bool io_in_bounds(struct TiffIO *io, off_t offset, int64_t size){
+    return offset >= 0 && size >= 0 && offset <= io->size && size <= io->size - offset;
+}
+
+/*
+ * Trim a run to the part inside the file, returning false if none is.
+ */
+static bool io_clip(struct TiffIO *io, off_t *offset, int64_t *size){
+    if(*offset < 0){
+        *size += *offset;
+        *offset = 0;
+    }
+    if(*offset >= io->size || *size <= 0){
+        return false;
+    }
+    if(*size > io->size - *offset){
+        if(DEBUG) printf("Range at 0x%llx runs past end of file, clipping\n", (unsigned long long)*offset);
+        *size = io->size - *offset;
+    }
+    return true;
+}
+
+/*
+ * Read size bytes at offset straight from the device, counting the reads.
+ */
+static bool device_read(struct TiffIO *io, off_t offset, void *buf, int64_t size){
+    while(size > 0){
+        ssize_t got = pread(fileno(io->fp), buf, size, offset);
+        if(got <= 0){
+            return false;
+        }
+        if(io->cache){
+            io->cache->device_reads += 1;
+            io->cache->device_bytes += got;
+        }
+        stats_read(io, offset, got, 1);
+        buf = (uint8 *)buf + got;
+        offset += got;
+        size -= got;
+    }
+    return true;
+}
+
+/*
+ * Load the aligned block holding offset into the least recently used slot.
+ * A miss starting where the last device read ended means the reads are
+ * running forward, so the blocks double; a jump puts them back to the
+ * starting size.
+ */
+static struct CacheBlock *cache_fill(struct TiffIO *io, off_t offset){
+    struct BlockCache *cache = io->cache;
+    size_t block_size = cache->block_size;
+    off_t start = offset - offset % block_size;
+    if(start == cache->last_end && block_size < MAX_READ_BLOCK){
+        block_size *= 2;
+    } else if(start != cache->last_end){
+        block_size = cache->first_block;
+    }
+    cache->block_size = block_size;
+    if(block_size > cache->largest_block){
+        cache->largest_block = block_size;
+    }
+    start = offset - offset % block_size;
+    struct CacheBlock *block = &cache->blocks[0];
+    for(int i = 1; i < CACHE_BLOCKS; i++){
+        if(cache->blocks[i].used < block->used){
+            block = &cache->blocks[i];
+        }
+    }
+    if(block->capacity < (int64_t)block_size){
+        uint8 *data = realloc(block->data, block_size);
+        if(data == NULL){
+            return NULL;
+        }
+        block->data = data;
+        block->capacity = block_size;
+    }
+    int64_t size = io->size - start < (int64_t)block_size ? io->size - start : (int64_t)block_size;
+    block->size = 0;
+    if(!device_read(io, start, block->data, size)){
+        return NULL;
+    }
+    block->start = start;
+    block->size = size;
+    cache->last_end = start + size;
+    return block;
+}
+
+/*
+ * Serve a small read from the cached blocks, filling them as needed. Reads
+ * as big as a block go straight to the device.
+ */
+static bool cache_read(struct TiffIO *io, off_t offset, void *buf, int64_t size){
+    struct BlockCache *cache = io->cache;
+    if(size >= (int64_t)cache->block_size){
+        return device_read(io, offset, buf, size);
+    }
+    while(size > 0){
+        struct CacheBlock *block = NULL;
+        for(int i = 0; i < CACHE_BLOCKS && block == NULL; i++){
+            struct CacheBlock *candidate = &cache->blocks[i];
+            if(offset >= candidate->start && offset < candidate->start + candidate->size){
+                block = candidate;
+                cache->hits += 1;
+            }
+        }
+        if(block == NULL && (block = cache_fill(io, offset)) == NULL){
+            return false;
+        }
+        block->used = ++cache->clock;
+        int64_t chunk = block->start + block->size - offset;
+        if(chunk > size){
+            chunk = size;
+        }
+        memcpy(buf, block->data + (offset - block->start), chunk);
+        buf = (uint8 *)buf + chunk;
+        offset += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+/*
+ * Keep cached blocks in step with a write, or drop them all when size is
+ * negative, after writes that bypass io_write.
+ */
+static void cache_update(struct TiffIO *io, off_t offset, const void *buf, int64_t size){
+    struct BlockCache *cache = io->cache;
+    for(int i = 0; cache && i < CACHE_BLOCKS; i++){
+        struct CacheBlock *block = &cache->blocks[i];
+        if(size < 0){
+            block->size = 0;
+            continue;
+        }
+        off_t start = offset > block->start ? offset : block->start;
+        off_t end = offset + size < block->start + block->size ? offset + size : block->start + block->size;
+        if(start < end){
+            memcpy(block->data + (start - block->start), (const uint8 *)buf + (start - offset), end - start);
+        }
+    }
+}
+
+/*
+ * Ask for bytes the walk has found it will need, such as the next IFD, to
+ * be read ahead while it works on what it has.
+ */
+static void io_prefetch(struct TiffIO *io, off_t offset, int64_t size){
+    if(io->cache == NULL || !io_in_bounds(io, offset, 0)){
+        return;
+    }
+    if(size > io->size - offset){
+        size = io->size - offset;
+    }
+    posix_fadvise(fileno(io->fp), offset, size, POSIX_FADV_WILLNEED);
+    io->cache->hints += 1;
+    stats_call(io);
+}
+
+/*
+ * A tiff read from a pipe. What has been read is spooled to an unlinked
+ * temporary file, which the parser reads from as it would the file itself,
+ * until everything the chain points at is known; the rest passes straight
+ * through. The spool never grows past limit. The size isn't known until
+ * the input ends, so reads past the end fail instead of bounds checks.
+ */
+struct Stream {
+    FILE *in;
+    FILE *out;
+    off_t spooled;
+    off_t limit;
+    bool ended;
+    // a read needed more than the limit
+    bool overflowed;
+};
+
+/*
+ * Spool the input up to end, failing when it ends first or end is past the
+ * limit.
+ */
+static bool stream_fill(struct TiffIO *io, off_t end){
+    struct Stream *stream = io->stream;
+    uint8 buffer[64 * 1024];
+    if(end > stream->limit){
+        stream->overflowed = true;
+        return false;
+    }
+    while(stream->spooled < end && !stream->ended){
+        size_t want = stream->limit - stream->spooled < (off_t)sizeof(buffer) ? (size_t)(stream->limit - stream->spooled) : sizeof(buffer);
+        size_t got = fread(buffer, 1, want, stream->in);
+        stats_read(io, -1, got, 1);
+        if(got == 0){
+            stream->ended = true;
+        } else if(pwrite(fileno(io->fp), buffer, got, stream->spooled) != (ssize_t)got){
+            return false;
+        }
+        stats_write(io, -1, got, 1);
+        stream->spooled += got;
+    }
+    return stream->spooled >= end;
+}
+
+static bool io_read(struct TiffIO *io, off_t offset, void *buf, int64_t size){
+    if(!io_in_bounds(io, offset, size)){
+        return false;
+    }
+    if(io->stream){
+        if(!stream_fill(io, offset + size) || pread(fileno(io->fp), buf, size, offset) != size){
+            return false;
+        }
+        stats_read(io, offset, size, 1);
+        return true;
+    }
+    if(io->map){
+        memcpy(buf, io->map + offset, size);
+        stats_read(io, offset, size, 0);
+        return true;
+    }
+    if(io->cache){
+        return cache_read(io, offset, buf, size);
+    }
+    fseeko(io->fp, offset, SEEK_SET);
+    stats_read(io, offset, size, 1);
+    return fread(buf, 1, size, io->fp) == (size_t)size;
+}
+
+/*
+ * Return a pointer to size bytes at offset. With a mapping this is a view
+ * into the file and nothing is copied, otherwise the bytes are read into
+ * *scratch which the caller must free.
+ */
+static const void *io_view(struct TiffIO *io, off_t offset, int64_t size, void **scratch){
+    if(!io_in_bounds(io, offset, size)){
+        return NULL;
+    }
+    if(io->map){
+        stats_read(io, offset, size, 0);
+        return io->map + offset;
+    }
+    void *buf = realloc(*scratch, size ? size : 1);
+    if(buf == NULL){
+        return NULL;
+    }
+    *scratch = buf;
+    if(!io_read(io, offset, buf, size)){
+        return NULL;
+    }
+    return buf;
+}
+
+static bool io_write(struct TiffIO *io, off_t offset, const void *buf, int64_t size){
+    if(!io_in_bounds(io, offset, size)){
+        return false;
+    }
+    if(io->map){
+        memcpy(io->map + offset, buf, size);
+        stats_write(io, offset, size, 0);
+        return true;
+    }
+    stats_write(io, offset, size, 1);
+    if(io->cache){
+        // written through, so reads that miss the cache see it too
+        cache_update(io, offset, buf, size);
+        return pwrite(fileno(io->fp), buf, size, offset) == size;
+    }
+    fseeko(io->fp, offset, SEEK_SET);
+    return fwrite(buf, 1, size, io->fp) == (size_t)size;
+}
+
+static uint64_t load_offset(struct TiffIO *io, const uint8 *p){
+    uint64_t value = 0;
+    memcpy(&value, p, io->offset_size);
+    return value;
+}
+
+static void swap_array(uint8 *p, int64_t count, int width);
+static void swap_table(struct TiffIO *io, uint8 *table, uint64_t ifd_count, bool to_host);
+
+/*
+ * Like io_view, for an array of count elements of width bytes, returned in
+ * host order. Only a file in the other byte order is copied and swapped.
+ */
+static const void *io_view_array(struct TiffIO *io, off_t offset, uint64_t count, int width, void **scratch){
+    if(count > (uint64_t)io->size / width){
+        return NULL;
+    }
+    int64_t size = count * width;
+    if(!io->swap){
+        return io_view(io, offset, size, scratch);
+    }
+    void *buf = realloc(*scratch, size ? size : 1);
+    if(buf == NULL){
+        return NULL;
+    }
+    *scratch = buf;
+    if(!io_read(io, offset, buf, size)){
+        return NULL;
+    }
+    swap_array(buf, count, width);
+    return buf;
+}
+
+/*
+ * Read the entry count at the start of an IFD.
+ */
+static bool io_read_count(struct TiffIO *io, off_t offset, uint64_t *ifd_count){
+    *ifd_count = 0;
+    if(!io_read(io, offset, ifd_count, io->ifd_count_size)){
+        return false;
+    }
+    if(io->swap){
+        swap_array((uint8 *)ifd_count, 1, io->ifd_count_size);
+    }
+    return true;
+}
+
+/*
+ * View the rows and next offset of an IFD with ifd_count entries, in host
+ * order.
+ */
+static const void *io_view_table(struct TiffIO *io, off_t offset, uint64_t ifd_count, void **scratch){
+    if(ifd_count > (uint64_t)io->size / io->ifd_row_size){
+        return NULL;
+    }
+    int64_t size = io->ifd_row_size * ifd_count + io->offset_size;
+    const void *table = io_view(io, offset + io->ifd_count_size, size, scratch);
+    if(table == NULL || !io->swap){
+        return table;
+    }
+    if(table != *scratch){
+        void *buf = realloc(*scratch, size);
+        if(buf == NULL){
+            return NULL;
+        }
+        memcpy(buf, table, size);
+        *scratch = buf;
+    }
+    swap_table(io, *scratch, ifd_count, true);
+    return *scratch;
+}
+
+/*
+ * Write an offset, such as a link pointer, in the file's byte order.
+ */
+static bool io_write_offset(struct TiffIO *io, off_t offset, uint64_t value){
+    if(io->swap){
+        swap_array((uint8 *)&value, 1, io->offset_size);
+    }
+    return io_write(io, offset, &value, io->offset_size);
+}
+
+/*
+ * Make everything written so far durable, through the mapping and stdio.
+ */
+static bool io_sync(struct TiffIO *io){
+    if(io->map){
+        stats_call(io);
+        if(msync(io->map, io->size, MS_SYNC) != 0){
+            return false;
+        }
+    }
+    stats_call(io);
+    return fflush(io->fp) == 0 && fdatasync(fileno(io->fp)) == 0;
+}
+
+/*
+ * Write size bytes at the end of the file, starting at the first word
+ * boundary, and grow the mapping to cover them. *offset is where they went.
+ */
+static bool io_append(struct TiffIO *io, const void *buf, int64_t size, off_t *offset){
+    off_t start = (io->size + 1) & ~(off_t)1;
+    fflush(io->fp);
+    if(start > io->size && pwrite(fileno(io->fp), ZEROS, start - io->size, io->size) != start - io->size){
+        return false;
+    }
+    for(int64_t done = 0; done < size;){
+        ssize_t written = pwrite(fileno(io->fp), (const uint8 *)buf + done, size - done, start + done);
+        if(written <= 0){
+            return false;
+        }
+        stats_write(io, start + done, written, 1);
+        done += written;
+    }
+    if(io->map){
+        void *map = mmap(NULL, start + size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(io->fp), 0);
+        munmap(io->map, io->size);
+        // stdio still works if the larger mapping can't be had
+        io->map = map != MAP_FAILED ? map : NULL;
+    }
+    io->size = start + size;
+    cache_update(io, 0, NULL, -1);
+    *offset = start;
+    return true;
+}
+
+/*
+ * Size of one value of each data type, indexed by type. Unknown types are
+ * treated as zero sized, which keeps them inline.
+ */
+static const uint8 TIFF_TYPE_SIZES[] = {
+    [TIFF_NOTYPE] = 0,                  /* placeholder */
+    [TIFF_BYTE] = sizeof(uint8),        /* 8-bit unsigned integer */
+    [TIFF_ASCII] = sizeof(uint8),       /* 8-bit bytes w/ last byte null */
+    [TIFF_SHORT] = sizeof(uint16),      /* 16-bit unsigned integer */
+    [TIFF_LONG] = sizeof(uint32),       /* 32-bit unsigned integer */
+    [TIFF_RATIONAL] = sizeof(uint64_t), /* 64-bit unsigned fraction */
+    [TIFF_SBYTE] = sizeof(uint8),       /* !8-bit signed integer */
+    [TIFF_UNDEFINED] = sizeof(uint8),   /* !8-bit untyped data */
+    [TIFF_SSHORT] = sizeof(uint16),     /* !16-bit signed integer */
+    [TIFF_SLONG] = sizeof(uint32),      /* !32-bit signed integer */
+    [TIFF_SRATIONAL] = sizeof(uint64_t),/* !64-bit signed fraction */
+    [TIFF_FLOAT] = sizeof(uint32),      /* !32-bit IEEE floating point */
+    [TIFF_DOUBLE] = sizeof(uint64_t),   /* !64-bit IEEE floating point */
+    [TIFF_IFD] = sizeof(uint32),        /* %32-bit unsigned integer (offset) */
+    [TIFF_LONG8] = sizeof(uint64_t),    /* BigTIFF 64-bit unsigned integer */
+    [TIFF_SLONG8] = sizeof(uint64_t),   /* BigTIFF 64-bit signed integer */
+    [TIFF_IFD8] = sizeof(uint64_t),     /* BigTIFF 64-bit unsigned integer (offset) */
+};
+
+static inline int ifd_value_size(uint16 tag_type){
+    return tag_type < sizeof(TIFF_TYPE_SIZES) ? TIFF_TYPE_SIZES[tag_type] : 0;
+}
+
+/*
+ * Byte order. The order is picked once per file: when it matches the host
+ * nothing below runs and tables and arrays are used as they sit in the
+ * file. Otherwise whole IFD tables and offset/bytecount arrays are swapped
+ * in bulk as they are read, so the parsing code only ever sees host order.
+ */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define HOST_BYTE_ORDER TIFF_BIGENDIAN
+#else
+#define HOST_BYTE_ORDER TIFF_LITTLEENDIAN
+#endif
+
+static void swap16_array(uint8 *p, int64_t count){
+    int64_t i = 0;
+#if defined(__SSE2__)
+    for(; i + 8 <= count; i += 8){
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i * 2));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128((__m128i *)(p + i * 2), v);
+    }
+#elif defined(__ARM_NEON)
+    for(; i + 8 <= count; i += 8){
+        vst1q_u8(p + i * 2, vrev16q_u8(vld1q_u8(p + i * 2)));
+    }
+#endif
+    for(; i < count; i++){
+        uint16 v;
+        memcpy(&v, p + i * 2, 2);
+        v = __builtin_bswap16(v);
+        memcpy(p + i * 2, &v, 2);
+    }
+}
+
+static void swap32_array(uint8 *p, int64_t count){
+    int64_t i = 0;
+#if defined(__SSSE3__)
+    const __m128i order = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    for(; i + 4 <= count; i += 4){
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i * 4));
+        _mm_storeu_si128((__m128i *)(p + i * 4), _mm_shuffle_epi8(v, order));
+    }
+#elif defined(__SSE2__)
+    for(; i + 4 <= count; i += 4){
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i * 4));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        _mm_storeu_si128((__m128i *)(p + i * 4), v);
+    }
+#elif defined(__ARM_NEON)
+    for(; i + 4 <= count; i += 4){
+        vst1q_u8(p + i * 4, vrev32q_u8(vld1q_u8(p + i * 4)));
+    }
+#endif
+    for(; i < count; i++){
+        uint32 v;
+        memcpy(&v, p + i * 4, 4);
+        v = __builtin_bswap32(v);
+        memcpy(p + i * 4, &v, 4);
+    }
+}
+
+static void swap64_array(uint8 *p, int64_t count){
+    int64_t i = 0;
+#if defined(__SSSE3__)
+    const __m128i order = _mm_set_epi8(8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7);
+    for(; i + 2 <= count; i += 2){
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i * 8));
+        _mm_storeu_si128((__m128i *)(p + i * 8), _mm_shuffle_epi8(v, order));
+    }
+#elif defined(__SSE2__)
+    for(; i + 2 <= count; i += 2){
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i * 8));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+        _mm_storeu_si128((__m128i *)(p + i * 8), v);
+    }
+#elif defined(__ARM_NEON)
+    for(; i + 2 <= count; i += 2){
+        vst1q_u8(p + i * 8, vrev64q_u8(vld1q_u8(p + i * 8)));
+    }
+#endif
+    for(; i < count; i++){
+        uint64_t v;
+        memcpy(&v, p + i * 8, 8);
+        v = __builtin_bswap64(v);
+        memcpy(p + i * 8, &v, 8);
+    }
+}
+
+static void swap_array(uint8 *p, int64_t count, int width){
+    switch(width){
+        case 2:
+            swap16_array(p, count);
+            break;
+        case 4:
+            swap32_array(p, count);
+            break;
+        case 8:
+            swap64_array(p, count);
+            break;
+    }
+}
+
+/*
+ * Width of the units a value of this type is swapped in. Rationals are
+ * pairs of 32-bit integers rather than one 64-bit one.
+ */
+static int ifd_swap_size(uint16 tag_type){
+    if(tag_type == TIFF_RATIONAL || tag_type == TIFF_SRATIONAL){
+        return sizeof(uint32);
+    }
+    return ifd_value_size(tag_type);
+}
+
+/*
+ * Swap one IFD row between file and host order. Inline values are swapped
+ * element by element according to their type, offsets as a whole.
+ */
+static void swap_row(struct TiffIO *io, uint8 *row, bool to_host){
+    uint16 tag_type;
+    memcpy(&tag_type, row + 2, sizeof(uint16));
+    if(to_host){
+        tag_type = __builtin_bswap16(tag_type);
+    }
+    swap16_array(row, 2);
+    uint8 *count = row + 4;
+    uint8 *value = row + 4 + io->offset_size;
+    uint64_t elements = 0;
+    if(!to_host){
+        memcpy(&elements, count, io->offset_size);
+    }
+    swap_array(count, 1, io->offset_size);
+    if(to_host){
+        memcpy(&elements, count, io->offset_size);
+    }
+    int width = ifd_swap_size(tag_type);
+    if(ifd_value_size(tag_type) * elements > (uint64_t)io->offset_size){
+        swap_array(value, 1, io->offset_size);
+    } else if(width > 1){
+        swap_array(value, io->offset_size / width, width);
+    }
+}
+
+/*
+ * Swap a whole IFD table, rows and next offset, between file and host
+ * order.
+ */
+static void swap_table(struct TiffIO *io, uint8 *table, uint64_t ifd_count, bool to_host){
+    for(uint64_t i = 0; i < ifd_count; i++){
+        swap_row(io, table + i * io->ifd_row_size, to_host);
+    }
+    swap_array(table + ifd_count * io->ifd_row_size, 1, io->offset_size);
+}
+
+static struct BIGIFD* find_big_tag(struct BIGIFD ifds[], int64_t ifd_count, uint16 tag){
+    for(int64_t i = 0; i < ifd_count; i++){
+        if(ifds[i].tag == tag){
+            return &ifds[i];
+        }
+    }
+    return 0;
+}
+
+/*
+ * Byte ranges waiting to be cleared. Ranges are gathered for every doomed
+ * page first, then sorted and merged so each run is written only once.
+ */
+struct Range {
+    off_t start;
+    int64_t size;
+};
+
+struct RangeList {
+    struct Range *items;
+    size_t count;
+    size_t capacity;
+};
+
+static void range_add(struct RangeList *list, off_t start, int64_t size){
+    if(size <= 0){
+        return;
+    }
+    // tiles are usually laid out back to back, so grow the last range when we can
+    if(list->count > 0){
+        struct Range *last = &list->items[list->count - 1];
+        if(start >= last->start && start <= last->start + last->size){
+            if(start + size > last->start + last->size){
+                last->size = start + size - last->start;
+            }
+            return;
+        }
+    }
+    if(list->count == list->capacity){
+        list->capacity = list->capacity ? list->capacity * 2 : 256;
+        list->items = realloc(list->items, list->capacity * sizeof(struct Range));
+    }
+    list->items[list->count].start = start;
+    list->items[list->count].size = size;
+    list->count += 1;
+}
+
+static int range_compare(const void *a, const void *b){
+    off_t left = ((const struct Range *)a)->start;
+    off_t right = ((const struct Range *)b)->start;
+    return (left > right) - (left < right);
+}
+
+static void range_coalesce(struct RangeList *list){
+    if(list->count < 2){
+        return;
+    }
+    // ranges mostly arrive in file order already, and then need no sort
+    size_t sorted = 1;
+    while(sorted < list->count && list->items[sorted - 1].start <= list->items[sorted].start){
+        sorted += 1;
+    }
+    if(sorted < list->count){
+        qsort(list->items, list->count, sizeof(struct Range), range_compare);
+    }
+    size_t merged = 0;
+    for(size_t i = 1; i < list->count; i++){
+        struct Range *last = &list->items[merged];
+        struct Range *next = &list->items[i];
+        if(next->start <= last->start + last->size){
+            if(next->start + next->size > last->start + last->size){
+                last->size = next->start + next->size - last->start;
+            }
+        } else {
+            merged += 1;
+            list->items[merged] = *next;
+        }
+    }
+    list->count = merged + 1;
+}
+
+/*
+ * Remove from list every byte covered by keep. Both must be coalesced, so
+ * one sweep over the two does it, splitting ranges where kept bytes fall in
+ * their middle.
+ */
+static void range_subtract(struct RangeList *list, const struct RangeList *keep){
+    if(list->count == 0 || keep == NULL || keep->count == 0){
+        return;
+    }
+    struct Range *items = malloc((list->count + keep->count) * sizeof(struct Range));
+    size_t count = 0;
+    size_t k = 0;
+    for(size_t i = 0; i < list->count; i++){
+        off_t start = list->items[i].start;
+        off_t end = start + list->items[i].size;
+        while(k < keep->count && keep->items[k].start + keep->items[k].size <= start){
+            k += 1;
+        }
+        for(size_t j = k; j < keep->count && keep->items[j].start < end; j++){
+            if(keep->items[j].start > start){
+                items[count].start = start;
+                items[count++].size = keep->items[j].start - start;
+            }
+            if(keep->items[j].start + keep->items[j].size > start){
+                start = keep->items[j].start + keep->items[j].size;
+            }
+        }
+        if(start < end){
+            items[count].start = start;
+            items[count++].size = end - start;
+        }
+    }
+    free(list->items);
+    list->items = items;
+    list->count = count;
+    list->capacity = list->count + keep->count;
+}
+
+/*
+ * Whether two coalesced lists share any byte, setting at to the first one.
+ */
+static bool range_intersects(const struct RangeList *a, const struct RangeList *b, off_t *at){
+    size_t i = 0;
+    size_t j = 0;
+    while(i < a->count && j < b->count){
+        off_t start = a->items[i].start > b->items[j].start ? a->items[i].start : b->items[j].start;
+        off_t a_end = a->items[i].start + a->items[i].size;
+        off_t b_end = b->items[j].start + b->items[j].size;
+        if(start < a_end && start < b_end){
+            *at = start;
+            return true;
+        }
+        if(a_end <= b_end){
+            i += 1;
+        } else {
+            j += 1;
+        }
+    }
+    return false;
+}
+
+/*
+ * The gaps of a coalesced list between 0 and end.
+ */
+static void range_complement(const struct RangeList *list, off_t end, struct RangeList *gaps){
+    off_t cursor = 0;
+    for(size_t i = 0; i < list->count && cursor < end; i++){
+        if(list->items[i].start > cursor){
+            range_add(gaps, cursor, (list->items[i].start < end ? list->items[i].start : end) - cursor);
+        }
+        if(list->items[i].start + list->items[i].size > cursor){
+            cursor = list->items[i].start + list->items[i].size;
+        }
+    }
+    if(cursor < end){
+        range_add(gaps, cursor, end - cursor);
+    }
+}
+
+static void range_free(struct RangeList *list){
+    free(list->items);
+    memset(list, 0, sizeof(struct RangeList));
+}
+
+/*
+ * An io_uring submission queue for the clearing and relinking writes. Writes
+ * are queued with deep queue depth and completions are reaped as the queue
+ * fills, so scattered ranges keep the device busy instead of waiting on
+ * each write in turn. The ring is set up with raw syscalls so there is no
+ * dependency on liburing.
+ */
+#ifdef HAVE_IO_URING
+#define RING_DEPTH 256
+
+struct RingOp {
+    const void *buf;
+    uint32 size;
+    off_t offset;
+    int fd;
+    uint8 data[8];
+};
+
+struct TiffsnipRing {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_map_size, cq_map_size, sqes_size;
+    unsigned queued;
+    unsigned in_flight;
+    struct RingOp ops[RING_DEPTH];
+    unsigned free_ops[RING_DEPTH];
+    unsigned free_count;
+    int error;
+    // totals for the report printed when the ring is torn down
+    uint64_t enters;
+    uint64_t writes;
+    uint64_t bytes;
+    double seconds;
+};
+
+static struct TiffsnipRing *ring_create(){
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, RING_DEPTH, &params);
+    if(fd < 0){
+        return NULL;
+    }
+    struct TiffsnipRing *ring = calloc(1, sizeof(struct TiffsnipRing));
+    ring->fd = fd;
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP){
+        if(ring->cq_map_size > ring->sq_map_size){
+            ring->sq_map_size = ring->cq_map_size;
+        }
+        ring->cq_map_size = ring->sq_map_size;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if(params.features & IORING_FEAT_SINGLE_MMAP){
+        ring->cq_map = ring->sq_map;
+    } else {
+        ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    }
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED){
+        close(fd);
+        free(ring);
+        return NULL;
+    }
+    uint8 *sq = ring->sq_map;
+    uint8 *cq = ring->cq_map;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    for(unsigned i = 0; i < RING_DEPTH; i++){
+        ring->free_ops[i] = i;
+    }
+    ring->free_count = RING_DEPTH;
+    return ring;
+}
+
+/*
+ * Say what the ring has written so far and the IOPS and bandwidth it got.
+ */
+static void ring_print_stats(const struct TiffsnipRing *ring, FILE *out){
+    if(ring->writes){
+        double seconds = ring->seconds > 0 ? ring->seconds : 1e-9;
+        fprintf(out, "io_uring: %llu writes, %.1f MiB in %.3f s (%.0f IOPS, %.1f MiB/s)\n",
+                (unsigned long long)ring->writes, ring->bytes / 1048576.0, ring->seconds,
+                ring->writes / seconds, ring->bytes / 1048576.0 / seconds);
+    }
+}
+
+static void ring_destroy(struct TiffsnipRing *ring){
+    munmap(ring->sqes, ring->sqes_size);
+    if(ring->cq_map != ring->sq_map){
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+    munmap(ring->sq_map, ring->sq_map_size);
+    close(ring->fd);
+    free(ring);
+}
+
+/*
+ * Submit everything queued and wait for at least wait_for completions,
+ * then reap whatever has completed. A write the kernel can't do this way
+ * (older kernels lack IORING_OP_WRITE) or only did in part is finished
+ * with pwrite.
+ */
+static bool ring_reap(struct TiffsnipRing *ring, unsigned wait_for){
+    while(ring->queued || wait_for){
+        int submitted = syscall(__NR_io_uring_enter, ring->fd, ring->queued, wait_for,
+                                wait_for ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if(submitted < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            ring->error = errno;
+            return false;
+        }
+        ring->enters += 1;
+        ring->queued -= submitted;
+        ring->in_flight += submitted;
+        break;
+    }
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while(head != tail){
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        struct RingOp *op = &ring->ops[cqe->user_data];
+        int64_t done = cqe->res;
+        if(done == -EINVAL || done == -EOPNOTSUPP){
+            done = 0;
+        }
+        if(done < 0){
+            ring->error = -done;
+        } else if(done < op->size){
+            ssize_t rest = pwrite(op->fd, (const uint8 *)op->buf + done, op->size - done, op->offset + done);
+            if(rest != (ssize_t)(op->size - done)){
+                ring->error = rest < 0 ? errno : EIO;
+            }
+        }
+        ring->free_ops[ring->free_count++] = cqe->user_data;
+        ring->in_flight -= 1;
+        head += 1;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return ring->error == 0;
+}
+
+/*
+ * Queue a write. small writes (link pointers) are copied into the op so the
+ * caller's buffer can go away, larger ones must stay valid until drained.
+ */
+static bool ring_write(struct TiffsnipRing *ring, int fd, const void *buf, uint32 size, off_t offset){
+    while(ring->free_count == 0){
+        if(!ring_reap(ring, 1)){
+            return false;
+        }
+    }
+    unsigned index = ring->free_ops[--ring->free_count];
+    struct RingOp *op = &ring->ops[index];
+    op->fd = fd;
+    op->size = size;
+    op->offset = offset;
+    op->buf = buf;
+    if(size <= sizeof(op->data)){
+        memcpy(op->data, buf, size);
+        op->buf = op->data;
+    }
+    unsigned tail = *ring->sq_tail;
+    unsigned slot = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[slot];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)op->buf;
+    sqe->len = size;
+    sqe->off = offset;
+    sqe->user_data = index;
+    ring->sq_array[slot] = slot;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued += 1;
+    ring->writes += 1;
+    ring->bytes += size;
+    return true;
+}
+
+static bool ring_drain(struct TiffsnipRing *ring){
+    while(ring->queued || ring->in_flight){
+        if(!ring_reap(ring, ring->in_flight + ring->queued)){
+            return false;
+        }
+    }
+    return true;
+}
+#else
+struct TiffsnipRing;
+static struct TiffsnipRing *ring_create(){
+    errno = ENOSYS;
+    return NULL;
+}
+static void ring_print_stats(const struct TiffsnipRing *ring, FILE *out){
+    (void)ring;
+    (void)out;
+}
+static void ring_destroy(struct TiffsnipRing *ring){
+    (void)ring;
+}
+#endif
+
+/*
+ * Offset of the first nonzero byte in p, or size if there is none. Blocks
+ * of 64 bytes are OR-ed together in vector registers and tested once, so
+ * clean data streams through at memory speed.
+ */
+static size_t find_nonzero(const uint8 *p, size_t size){
+    size_t i = 0;
+#if defined(__AVX2__)
+    for(; i + 64 <= size; i += 64){
+        __m256i v = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(p + i)),
+                                    _mm256_loadu_si256((const __m256i *)(p + i + 32)));
+        if(!_mm256_testz_si256(v, v)){
+            break;
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for(; i + 64 <= size; i += 64){
+        __m128i v = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i *)(p + i)),
+                                              _mm_loadu_si128((const __m128i *)(p + i + 16))),
+                                 _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + i + 32)),
+                                              _mm_loadu_si128((const __m128i *)(p + i + 48))));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xFFFF){
+            break;
+        }
+    }
+#elif defined(__ARM_NEON)
+    for(; i + 64 <= size; i += 64){
+        uint8x16_t v = vorrq_u8(vorrq_u8(vld1q_u8(p + i), vld1q_u8(p + i + 16)),
+                                vorrq_u8(vld1q_u8(p + i + 32), vld1q_u8(p + i + 48)));
+        uint64x2_t words = vreinterpretq_u64_u8(v);
+        if((vgetq_lane_u64(words, 0) | vgetq_lane_u64(words, 1)) != 0){
+            break;
+        }
+    }
+#else
+    for(; i + 8 <= size; i += 8){
+        uint64_t word;
+        memcpy(&word, p + i, sizeof(word));
+        if(word){
+            break;
+        }
+    }
+#endif
+    for(; i < size; i++){
+        if(p[i]){
+            return i;
+        }
+    }
+    return size;
+}
+
+/*
+ * Random bytes for overwriting, from xoshiro256+ run on four independent
+ * streams at once so each step yields 32 bytes, in vector registers where
+ * there are some. It is fast rather than cryptographic, which is all a
+ * pattern laid over removed data needs.
+ */
+struct Random {
+    // word w of stream l is s[w][l]
+    uint64_t s[4][4];
+};
+
+static uint64_t splitmix64(uint64_t *x){
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static void random_seed(struct Random *random){
+    uint64_t seed;
+    if(getentropy(&seed, sizeof(seed)) != 0){
+        seed = (uint64_t)(now_seconds() * 1e9) ^ ((uint64_t)getpid() << 32);
+    }
+    for(int w = 0; w < 4; w++){
+        for(int l = 0; l < 4; l++){
+            random->s[w][l] = splitmix64(&seed);
+        }
+    }
+}
+
+/*
+ * Fill size bytes of p, a multiple of 32.
+ */
+static void fill_random(struct Random *random, uint8 *p, size_t size){
+#if defined(__AVX2__)
+    __m256i s0 = _mm256_loadu_si256((const __m256i *)random->s[0]);
+    __m256i s1 = _mm256_loadu_si256((const __m256i *)random->s[1]);
+    __m256i s2 = _mm256_loadu_si256((const __m256i *)random->s[2]);
+    __m256i s3 = _mm256_loadu_si256((const __m256i *)random->s[3]);
+    for(size_t i = 0; i < size; i += 32){
+        _mm256_storeu_si256((__m256i *)(p + i), _mm256_add_epi64(s0, s3));
+        __m256i t = _mm256_slli_epi64(s1, 17);
+        s2 = _mm256_xor_si256(s2, s0);
+        s3 = _mm256_xor_si256(s3, s1);
+        s1 = _mm256_xor_si256(s1, s2);
+        s0 = _mm256_xor_si256(s0, s3);
+        s2 = _mm256_xor_si256(s2, t);
+        s3 = _mm256_or_si256(_mm256_slli_epi64(s3, 45), _mm256_srli_epi64(s3, 19));
+    }
+    _mm256_storeu_si256((__m256i *)random->s[0], s0);
+    _mm256_storeu_si256((__m256i *)random->s[1], s1);
+    _mm256_storeu_si256((__m256i *)random->s[2], s2);
+    _mm256_storeu_si256((__m256i *)random->s[3], s3);
+#elif defined(__SSE2__)
+    // streams 0 and 1 in one register, 2 and 3 in the other
+    for(int half = 0; half < 2; half++){
+        __m128i s0 = _mm_loadu_si128((const __m128i *)(random->s[0] + 2 * half));
+        __m128i s1 = _mm_loadu_si128((const __m128i *)(random->s[1] + 2 * half));
+        __m128i s2 = _mm_loadu_si128((const __m128i *)(random->s[2] + 2 * half));
+        __m128i s3 = _mm_loadu_si128((const __m128i *)(random->s[3] + 2 * half));
+        for(size_t i = 16 * half; i < size; i += 32){
+            _mm_storeu_si128((__m128i *)(p + i), _mm_add_epi64(s0, s3));
+            __m128i t = _mm_slli_epi64(s1, 17);
+            s2 = _mm_xor_si128(s2, s0);
+            s3 = _mm_xor_si128(s3, s1);
+            s1 = _mm_xor_si128(s1, s2);
+            s0 = _mm_xor_si128(s0, s3);
+            s2 = _mm_xor_si128(s2, t);
+            s3 = _mm_or_si128(_mm_slli_epi64(s3, 45), _mm_srli_epi64(s3, 19));
+        }
+        _mm_storeu_si128((__m128i *)(random->s[0] + 2 * half), s0);
+        _mm_storeu_si128((__m128i *)(random->s[1] + 2 * half), s1);
+        _mm_storeu_si128((__m128i *)(random->s[2] + 2 * half), s2);
+        _mm_storeu_si128((__m128i *)(random->s[3] + 2 * half), s3);
+    }
+#elif defined(__ARM_NEON)
+    for(int half = 0; half < 2; half++){
+        uint64x2_t s0 = vld1q_u64(random->s[0] + 2 * half);
+        uint64x2_t s1 = vld1q_u64(random->s[1] + 2 * half);
+        uint64x2_t s2 = vld1q_u64(random->s[2] + 2 * half);
+        uint64x2_t s3 = vld1q_u64(random->s[3] + 2 * half);
+        for(size_t i = 16 * half; i < size; i += 32){
+            vst1q_u8(p + i, vreinterpretq_u8_u64(vaddq_u64(s0, s3)));
+            uint64x2_t t = vshlq_n_u64(s1, 17);
+            s2 = veorq_u64(s2, s0);
+            s3 = veorq_u64(s3, s1);
+            s1 = veorq_u64(s1, s2);
+            s0 = veorq_u64(s0, s3);
+            s2 = veorq_u64(s2, t);
+            s3 = vorrq_u64(vshlq_n_u64(s3, 45), vshrq_n_u64(s3, 19));
+        }
+        vst1q_u64(random->s[0] + 2 * half, s0);
+        vst1q_u64(random->s[1] + 2 * half, s1);
+        vst1q_u64(random->s[2] + 2 * half, s2);
+        vst1q_u64(random->s[3] + 2 * half, s3);
+    }
+#else
+    uint64_t (*s)[4] = random->s;
+    for(size_t i = 0; i < size; i += 32){
+        for(int l = 0; l < 4; l++){
+            uint64_t result = s[0][l] + s[3][l];
+            memcpy(p + i + 8 * l, &result, sizeof(result));
+            uint64_t t = s[1][l] << 17;
+            s[2][l] ^= s[0][l];
+            s[3][l] ^= s[1][l];
+            s[1][l] ^= s[2][l];
+            s[0][l] ^= s[3][l];
+            s[2][l] ^= t;
+            s[3][l] = (s[3][l] << 45) | (s[3][l] >> 19);
+        }
+    }
+#endif
+}
+
+/*
+ * Check that a range of the file reads as zeros, straight from the mapping
+ * or in large sequential reads. Returns false with at set to the first
+ * nonzero byte, or to -1 when the range couldn't be read.
+ */
+static bool range_is_zero(struct TiffIO *io, off_t start, int64_t size, off_t *at){
+    if(start + size > io->size){
+        size = start < io->size ? io->size - start : 0;
+    }
+    if(io->map){
+        off_t page = start & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+        madvise(io->map + page, size + (start - page), MADV_SEQUENTIAL);
+        stats_call(io);
+        stats_read(io, start, size, 0);
+        size_t found = find_nonzero(io->map + start, size);
+        *at = start + found;
+        return found == (size_t)size;
+    }
+    posix_fadvise(fileno(io->fp), start, size, POSIX_FADV_SEQUENTIAL);
+    stats_call(io);
+    uint8 *buffer = malloc(BUFFER_SIZE);
+    while(buffer && size > 0){
+        int64_t chunk = size > BUFFER_SIZE ? BUFFER_SIZE : size;
+        if(pread(fileno(io->fp), buffer, chunk, start) != chunk){
+            break;
+        }
+        stats_read(io, start, chunk, 1);
+        size_t found = find_nonzero(buffer, chunk);
+        if(found < (size_t)chunk){
+            free(buffer);
+            *at = start + found;
+            return false;
+        }
+        start += chunk;
+        size -= chunk;
+    }
+    free(buffer);
+    *at = -1;
+    return size == 0;
+}
+
+/*
+ * An undo journal holds the bytes of everything a snip overwrites, cleared
+ * ranges and link pointers alike, so --restore can put them back. After a
+ * short text header it is a run of binary records, all little endian:
+ *
+ *   tiffsnip journal 1
+ *   file <path>
+ *   size <bytes before the snip>
+ *   R <offset:8> <size:8> <packed size:8> <crc:4> <packed bytes>
+ *   ...
+ *   E <record count:8> <crc:4>
+ *
+ * Bytes are packed with PackBits, which costs little on tile data and
+ * shrinks the zeros and repeated values of tables a lot. Each crc is the
+ * CRC-32 of the record's fields and unpacked bytes. Records are written as
+ * the writes they undo are made and replayed newest first.
+ */
+#define JOURNAL_VERSION 1
+// a record holds at most this many bytes, packing can grow them by 1/128
+#define JOURNAL_CHUNK BUFFER_SIZE
+#define PACKED_SIZE(size) ((size) + (size) / 128 + 1)
+
+struct Journal {
+    // journals go in this directory, named after the file, its device and
+    // inode so files sharing a name in a batch don't share a journal, and
+    // a number counting the snips of it whose journals are still there
+    const char *dir;
+    char path[4096];
+    FILE *fp;
+    uint64_t records;
+    uint8 *packed;
+    bool failed;
+    int error;
+};
+
+static uint32 CRC_TABLE[256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void build_crc_table(){
+    for(uint32 i = 0; i < 256; i++){
+        uint32 crc = i;
+        for(int bit = 0; bit < 8; bit++){
+            crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+        }
+        CRC_TABLE[i] = crc;
+    }
+}
+
+static uint32 crc32_update(uint32 crc, const uint8 *p, size_t size){
+    pthread_once(&crc_table_once, build_crc_table);
+    crc = ~crc;
+    for(size_t i = 0; i < size; i++){
+        crc = CRC_TABLE[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/*
+ * PackBits: a header byte n of 0 to 127 is followed by n + 1 literal bytes,
+ * one of -1 to -127 by a byte repeated 1 - n times. out needs room for
+ * PACKED_SIZE(size) bytes.
+ */
+static size_t pack_bits(const uint8 *in, size_t size, uint8 *out){
+    size_t packed = 0;
+    size_t i = 0;
+    while(i < size){
+        size_t run = 1;
+        while(i + run < size && run < 128 && in[i + run] == in[i]){
+            run++;
+        }
+        if(run >= 3){
+            out[packed++] = (uint8)(257 - run);
+            out[packed++] = in[i];
+            i += run;
+            continue;
+        }
+        // literals up to the next run worth packing
+        size_t end = i;
+        while(end < size && end - i < 128 &&
+              !(end + 2 < size && in[end] == in[end + 1] && in[end] == in[end + 2])){
+            end++;
+        }
+        out[packed++] = (uint8)(end - i - 1);
+        memcpy(out + packed, in + i, end - i);
+        packed += end - i;
+        i = end;
+    }
+    return packed;
+}
+
+static bool unpack_bits(const uint8 *in, size_t size, uint8 *out, size_t out_size){
+    size_t done = 0;
+    size_t i = 0;
+    while(i < size){
+        int n = (int8_t)in[i++];
+        if(n >= 0){
+            if(i + n + 1 > size || done + n + 1 > out_size){
+                return false;
+            }
+            memcpy(out + done, in + i, n + 1);
+            i += n + 1;
+            done += n + 1;
+        } else if(n != -128){
+            if(i >= size || done + 1 - n > out_size){
+                return false;
+            }
+            memset(out + done, in[i++], 1 - n);
+            done += 1 - n;
+        }
+    }
+    return done == out_size;
+}
+
+static void store_le(uint8 *p, uint64_t value, int width){
+    for(int i = 0; i < width; i++){
+        p[i] = value >> (8 * i);
+    }
+}
+
+static uint64_t load_le(const uint8 *p, int width){
+    uint64_t value = 0;
+    for(int i = 0; i < width; i++){
+        value |= (uint64_t)p[i] << (8 * i);
+    }
+    return value;
+}
+
+/*
+ * Start the journal for io's file, before anything in it is written. An
+ * existing journal is never replaced, it may be the only undo of an
+ * earlier snip, so this one takes the next free number.
+ */
+static bool journal_open(struct TiffIO *io){
+    struct Journal *journal = io->journal;
+    const char *name = strrchr(io->path, '/');
+    struct stat st;
+    char *real = realpath(io->path, NULL);
+    if(real == NULL || stat(real, &st) != 0){
+        io_error(io, "Opening journal for %s failed: %s", io->path, strerror(errno));
+        free(real);
+        return false;
+    }
+    int fd = -1;
+    errno = EEXIST;
+    for(int number = 1; fd < 0 && errno == EEXIST; number++){
+        snprintf(journal->path, sizeof(journal->path), "%s/%s-%llx-%llx-%d.journal", journal->dir,
+                 name ? name + 1 : io->path, (unsigned long long)st.st_dev, (unsigned long long)st.st_ino, number);
+        fd = open(journal->path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    }
+    journal->fp = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if(fd >= 0 && journal->fp == NULL){
+        close(fd);
+    }
+    journal->packed = malloc(PACKED_SIZE(JOURNAL_CHUNK));
+    if(journal->fp == NULL || journal->packed == NULL){
+        io_error(io, "Opening journal %s failed: %s", journal->path, strerror(errno));
+        if(journal->fp){
+            fclose(journal->fp);
+            journal->fp = NULL;
+        }
+        free(journal->packed);
+        journal->packed = NULL;
+        free(real);
+        return false;
+    }
+    setvbuf(journal->fp, NULL, _IOFBF, BUFFER_SIZE);
+    fprintf(journal->fp, "tiffsnip journal %d\nfile %s\nsize %lld\n", JOURNAL_VERSION, real, (long long)io->size);
+    free(real);
+    return true;
+}
+
+/*
+ * Record the bytes at start before they are overwritten, a chunk at a time.
+ * Through a mapping they are packed in place, and with stdio each chunk is
+ * read just ahead of being cleared, so the file is still passed over once.
+ */
+static bool journal_range(struct TiffIO *io, off_t start, int64_t size){
+    struct Journal *journal = io->journal;
+    if(journal == NULL || journal->fp == NULL || !io_in_bounds(io, start, size)){
+        return true;
+    }
+    enum Phase previous = stats_phase(io, PHASE_JOURNAL);
+    void *scratch = NULL;
+    for(; size > 0 && !journal->failed; start += JOURNAL_CHUNK, size -= JOURNAL_CHUNK){
+        int64_t chunk = size > JOURNAL_CHUNK ? JOURNAL_CHUNK : size;
+        const uint8 *bytes = io_view(io, start, chunk, &scratch);
+        if(bytes == NULL){
+            journal->error = EIO;
+            journal->failed = true;
+            break;
+        }
+        size_t packed = pack_bits(bytes, chunk, journal->packed);
+        uint8 record[29];
+        record[0] = 'R';
+        store_le(record + 1, start, 8);
+        store_le(record + 9, chunk, 8);
+        store_le(record + 17, packed, 8);
+        uint32 crc = crc32_update(crc32_update(0, record, 25), bytes, chunk);
+        store_le(record + 25, crc, 4);
+        if(fwrite(record, 1, sizeof(record), journal->fp) != sizeof(record) ||
+           fwrite(journal->packed, 1, packed, journal->fp) != packed){
+            journal->error = errno;
+            journal->failed = true;
+        }
+        // buffered by stdio, so the calls aren't known
+        stats_write(io, -1, sizeof(record) + packed, 0);
+        journal->records += 1;
+    }
+    free(scratch);
+    stats_phase(io, previous);
+    // the caller stops and the journal's own error is reported in its place
+    return !journal->failed;
+}
+
+/*
+ * End the journal and make it durable, its one sync. A journal cut short
+ * by a failed snip is still ended, so what was cleared can be restored.
+ */
+static bool journal_close(struct Journal *journal){
+    if(journal->fp == NULL){
+        return !journal->failed;
+    }
+    uint8 record[13];
+    record[0] = 'E';
+    store_le(record + 1, journal->records, 8);
+    store_le(record + 9, crc32_update(0, record, 9), 4);
+    bool closed = fwrite(record, 1, sizeof(record), journal->fp) == sizeof(record) &&
+                  fflush(journal->fp) == 0 && fdatasync(fileno(journal->fp)) == 0;
+    closed = fclose(journal->fp) == 0 && closed;
+    if(!closed && !journal->failed){
+        journal->error = errno;
+    }
+    closed = closed && !journal->failed;
+    journal->failed = !closed;
+    journal->fp = NULL;
+    free(journal->packed);
+    journal->packed = NULL;
+    return closed;
+}
+
+/*
+ * Zero a run with large positional writes. This bypasses both the stdio
+ * buffer and the mapping, so pages being overwritten whole are never
+ * faulted in just to be zeroed.
+ */
+static bool tiff_clear(struct TiffIO *io, off_t start, int64_t size){
+    if(DEBUG) printf("Clearing %lld at 0x%llx\n", (long long)size, (unsigned long long)start);
+    if(!io_clip(io, &start, &size)){
+        return true;
+    }
+    int fd = fileno(io->fp);
+    while(size > 0){
+        size_t chunk = size > BUFFER_SIZE ? BUFFER_SIZE : size;
+        ssize_t written = pwrite(fd, ZEROS, chunk, start);
+        if(written <= 0){
+            return false;
+        }
+        stats_write(io, start, written, 1);
+        start += written;
+        size -= written;
+    }
+    return true;
+}
+
+/*
+ * Deallocate a run instead of writing it. Reads of a hole return zeros and
+ * the blocks go back to the filesystem at once. Returns false when the
+ * filesystem can't punch holes so the caller can write zeros instead.
+ */
+static bool tiff_punch(struct TiffIO *io, off_t start, int64_t size){
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if(DEBUG) printf("Punching %lld at 0x%llx\n", (long long)size, (unsigned long long)start);
+    if(!io_clip(io, &start, &size)){
+        return true;
+    }
+    stats_call(io);
+    return fallocate(fileno(io->fp), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, size) == 0;
+#else
+    errno = EOPNOTSUPP;
+    return false;
+#endif
+}
+
+/*
+ * Count the ranges about to be cleared for --stats, by how many were
+ * gathered, merged and left after skipping shared bytes, and by size.
+ */
+static void stats_ranges(struct TiffIO *io, size_t gathered, size_t coalesced, const struct RangeList *list){
+    struct SnipStats *stats = io->stats;
+    if(stats == NULL){
+        return;
+    }
+    stats->ranges_gathered += gathered;
+    stats->ranges_coalesced += coalesced;
+    stats->ranges_cleared += list->count;
+    for(size_t i = 0; i < list->count; i++){
+        stats->cleared_bytes += list->items[i].size;
+        stats->range_sizes[63 - __builtin_clzll(list->items[i].size)] += 1;
+    }
+}
+
+/*
+ * Lay io->random_passes passes of fresh random bytes over every range,
+ * each pass made durable before the next begins so none is merely
+ * overwritten in the page cache. The ranges are journaled first.
+ */
+static bool overwrite_random(struct TiffIO *io, struct RangeList *list){
+    for(size_t i = 0; i < list->count; i++){
+        if(!journal_range(io, list->items[i].start, list->items[i].size)){
+            return false;
+        }
+    }
+    struct Random random;
+    random_seed(&random);
+    uint8 *buffer = malloc(BUFFER_SIZE);
+    if(buffer == NULL){
+        return false;
+    }
+    int fd = fileno(io->fp);
+    for(int pass = 0; pass < io->random_passes; pass++){
+        for(size_t i = 0; i < list->count; i++){
+            off_t start = list->items[i].start;
+            int64_t size = list->items[i].size;
+            if(!io_clip(io, &start, &size)){
+                continue;
+            }
+            while(size > 0){
+                size_t chunk = size > BUFFER_SIZE ? BUFFER_SIZE : size;
+                fill_random(&random, buffer, (chunk + 31) & ~(size_t)31);
+                ssize_t written = pwrite(fd, buffer, chunk, start);
+                if(written <= 0){
+                    free(buffer);
+                    return false;
+                }
+                stats_write(io, start, written, 1);
+                start += written;
+                size -= written;
+            }
+        }
+        stats_call(io);
+        if(fdatasync(fd) != 0){
+            free(buffer);
+            return false;
+        }
+        if(DEBUG) printf("Random pass %d of %d done\n", pass + 1, io->random_passes);
+    }
+    free(buffer);
+    return true;
+}
+
+static bool overwrite_ranges(struct TiffIO *io, struct RangeList *list){
+    size_t gathered = list->count;
+    range_coalesce(list);
+    size_t coalesced = list->count;
+    range_subtract(list, io->keep);
+    // a tile running past the end of a truncated file is cleared up to it
+    size_t kept = 0;
+    for(size_t i = 0; i < list->count; i++){
+        if(io_clip(io, &list->items[i].start, &list->items[i].size)){
+            list->items[kept++] = list->items[i];
+        }
+    }
+    list->count = kept;
+    for(size_t i = 0; io->cleared && i < list->count; i++){
+        range_add(io->cleared, list->items[i].start, list->items[i].size);
+    }
+    stats_ranges(io, gathered, coalesced, list);
+    if(DEBUG) printf("Clearing %zu ranges, %zu before coalescing, %zu before skipping shared bytes\n",
+                     list->count, gathered, coalesced);
+    // anything written through stdio has to land before the positional writes
+    fflush(io->fp);
+    double started = now_seconds();
+#ifdef HAVE_IO_URING
+    uint64_t enters = io->ring ? io->ring->enters : 0;
+#endif
+    if(io->random_passes && !overwrite_random(io, list)){
+        return false;
+    }
+    // the zeros are the whole job, or a last pass after the random ones
+    bool zero = io->random_passes == 0 || io->final_zero;
+    for(size_t i = 0; zero && i < list->count; i++){
+        off_t start = list->items[i].start;
+        int64_t size = list->items[i].size;
+        if(io->random_passes == 0 && !journal_range(io, start, size)){
+            return false;
+        }
+        if(io->punch){
+            if(tiff_punch(io, start, size)){
+                continue;
+            }
+            if(io->log){
+                fprintf(io->log, "%s: hole punching is not supported here (%s), writing zeros instead\n",
+                        io->path, strerror(errno));
+            }
+            io->punch = false;
+        }
+#ifdef HAVE_IO_URING
+        if(io->ring){
+            if(!io_in_bounds(io, start, size)){
+                continue;
+            }
+            for(; size > 0; start += BUFFER_SIZE, size -= BUFFER_SIZE){
+                if(!ring_write(io->ring, fileno(io->fp), ZEROS, size > BUFFER_SIZE ? BUFFER_SIZE : size, start)){
+                    errno = io->ring->error;
+                    return false;
+                }
+                // submitted in batches, counted below
+                stats_write(io, start, size > BUFFER_SIZE ? BUFFER_SIZE : size, 0);
+            }
+            continue;
+        }
+#endif
+        if(!tiff_clear(io, start, size)){
+            return false;
+        }
+    }
+#ifdef HAVE_IO_URING
+    if(io->ring){
+        bool drained = ring_drain(io->ring);
+        io->ring->seconds += now_seconds() - started;
+        if(io->stats){
+            io->stats->write_calls += io->ring->enters - enters;
+        }
+        if(!drained){
+            errno = io->ring->error;
+            return false;
+        }
+    }
+#endif
+    (void)started;
+    if(io->random_passes && zero){
+        stats_call(io);
+        if(fdatasync(fileno(io->fp)) != 0){
+            return false;
+        }
+    }
+    // and neither the stdio read buffer nor the cache may serve bytes from
+    // before the clear
+    fflush(io->fp);
+    cache_update(io, 0, NULL, -1);
+    return true;
+}
+
+/*
+ * Clear the ranges, charging the time to clearing however it ends.
+ */
+static bool clear_ranges(struct TiffIO *io, struct RangeList *list){
+    enum Phase previous = stats_phase(io, PHASE_CLEAR);
+    bool cleared = overwrite_ranges(io, list);
+    stats_phase(io, previous);
+    return cleared;
+}
+
+/*
+ * Keep the gathered ranges within the memory limit by clearing them early
+ * once there are too many to hold. Ranges are coalesced first, since that
+ * often frees enough room on its own.
+ */
+static bool range_flush(struct TiffIO *io, struct RangeList *list){
+    if(io->range_limit == 0 || list->count < io->range_limit){
+        return true;
+    }
+    range_coalesce(list);
+    if(list->count < io->range_limit / 2){
+        return true;
+    }
+    if(DEBUG) printf("Range limit reached, clearing %zu ranges early\n", list->count);
+    if(!clear_ranges(io, list)){
+        io_error(io, "Writing zeros failed: %s", strerror(errno));
+        return false;
+    }
+    list->count = 0;
+    return true;
+}
+
+/*
+ * A pointer in the file that has to change, either the first IFD offset in
+ * the header or the next offset at the end of an IFD.
+ */
+struct Link {
+    off_t offset;
+    off_t value;
+};
+
+static off_t header_link_offset(struct TiffIO *io){
+    off_t offset = sizeof(struct Header);
+    if(io->big_tiff){
+        offset += sizeof(struct BigHeader);
+    }
+    return offset;
+}
+
+static off_t ifd_link_offset(struct TiffIO *io, off_t offset){
+    uint64_t ifd_count = 0;
+    if(!io_read_count(io, offset, &ifd_count)){
+        return -1;
+    }
+    return offset + io->ifd_count_size + io->ifd_row_size * ifd_count;
+}
+
+/*
+ * Work out the link rewrites that forward each survivor to the next
+ * survivor, only touching links that change. links needs room for
+ * page_count + 1 entries. Returns the number of links or -1.
+ */
+static int plan_links(struct TiffIO *io, off_t offsets[], bool doomed[], int page_count, struct Link links[]){
+    int count = 0;
+    int previous = -1;
+    for(int i = 0; i <= page_count; i++){
+        if(i < page_count && doomed[i]){
+            continue;
+        }
+        off_t value = i < page_count ? offsets[i] : 0;
+        if(previous == -1 && i != 0){
+            links[count].offset = header_link_offset(io);
+            links[count++].value = value;
+        } else if(previous != -1 && previous != i - 1){
+            links[count].offset = ifd_link_offset(io, offsets[previous]);
+            if(links[count].offset < 0){
+                return -1;
+            }
+            links[count++].value = value;
+        }
+        previous = i;
+    }
+    return count;
+}
+
+static bool write_links(struct TiffIO *io, struct Link links[], int count){
+    enum Phase previous = stats_phase(io, PHASE_RELINK);
+#ifdef HAVE_IO_URING
+    uint64_t enters = io->ring ? io->ring->enters : 0;
+#endif
+    for(int i = 0; i < count; i++){
+        if(DEBUG) printf("Overwriting link at 0x%llx -> 0x%llx\n", (unsigned long long)links[i].offset, (unsigned long long)links[i].value);
+        if(!journal_range(io, links[i].offset, io->offset_size)){
+            return false;
+        }
+#ifdef HAVE_IO_URING
+        if(io->ring && io_in_bounds(io, links[i].offset, io->offset_size)){
+            uint64_t value = links[i].value;
+            if(io->swap){
+                swap_array((uint8 *)&value, 1, io->offset_size);
+            }
+            if(!ring_write(io->ring, fileno(io->fp), &value, io->offset_size, links[i].offset)){
+                return false;
+            }
+            stats_write(io, links[i].offset, io->offset_size, 0);
+            continue;
+        }
+#endif
+        if(!io_write_offset(io, links[i].offset, links[i].value)){
+            return false;
+        }
+    }
+#ifdef HAVE_IO_URING
+    if(io->ring){
+        cache_update(io, 0, NULL, -1);
+        bool drained = ring_drain(io->ring);
+        if(io->stats){
+            io->stats->write_calls += io->ring->enters - enters;
+        }
+        stats_phase(io, previous);
+        return drained;
+    }
+#endif
+    stats_phase(io, previous);
+    return true;
+}
+
+/*
+ * Write fresh copies of the surviving IFD tables, already chained to each
+ * other, after the end of the file and make them durable. Only then is the
+ * header pointed at the first copy, a single pointer write, and that is made
+ * durable before anything is cleared. A crash at any point leaves the old
+ * chain or the new one, both whole. The survivors' offsets are updated and
+ * their old tables added to stale.
+ */
+static bool append_chain(struct TiffIO *io, off_t offsets[], bool doomed[], int page_count, struct RangeList *stale){
+    // io_append starts on the first word boundary past the end
+    off_t base = (io->size + 1) & ~(off_t)1;
+    uint8 *block = NULL;
+    int64_t block_size = 0;
+    // where each copy keeps its link, on the heap since a chain can be long
+    int64_t *links = malloc(page_count * sizeof(int64_t));
+    if(links == NULL && page_count > 0){
+        io_error(io, "Out of memory for %d pages", page_count);
+        return false;
+    }
+    void *scratch = NULL;
+    for(int i = 0; i < page_count; i++){
+        if(doomed[i]){
+            continue;
+        }
+        uint64_t ifd_count = 0;
+        const uint8 *table = NULL;
+        int64_t table_size = 0;
+        if(io_read_count(io, offsets[i], &ifd_count)){
+            table_size = io->ifd_count_size + io->ifd_row_size * ifd_count + io->offset_size;
+            table = io_view(io, offsets[i], table_size, &scratch);
+        }
+        uint8 *grown = table ? realloc(block, block_size + table_size) : NULL;
+        if(grown == NULL){
+            io_error(io, "IFD for page %d lies outside the file", i + 1);
+            free(scratch);
+            free(block);
+            free(links);
+            return false;
+        }
+        block = grown;
+        // copied as they are, in the file's byte order, so only links change;
+        // table sizes are all even so every copy stays on a word boundary
+        memcpy(block + block_size, table, table_size);
+        range_add(stale, offsets[i], table_size);
+        offsets[i] = base + block_size;
+        links[i] = block_size + table_size - io->offset_size;
+        block_size += table_size;
+    }
+    free(scratch);
+    if(!io->big_tiff && base + block_size > UINT32_MAX){
+        io_error(io, "No room to append a new chain to a classic tiff of this size");
+        free(block);
+        free(links);
+        return false;
+    }
+
+    int previous = -1;
+    for(int i = 0; i <= page_count; i++){
+        if(i < page_count && doomed[i]){
+            continue;
+        }
+        if(previous >= 0){
+            uint64_t value = i < page_count ? offsets[i] : 0;
+            if(io->swap){
+                swap_array((uint8 *)&value, 1, io->offset_size);
+            }
+            memcpy(block + links[previous], &value, io->offset_size);
+        }
+        previous = i;
+    }
+    free(links);
+
+    off_t appended;
+    bool written = io_append(io, block, block_size, &appended) && appended == base && io_sync(io);
+    free(block);
+    if(!written){
+        io_error(io, "Appending the new IFD chain failed: %s", strerror(errno));
+        return false;
+    }
+    if(DEBUG) printf("Appended %lld bytes of IFDs at 0x%llx\n", (long long)block_size, (long long)base);
+    int first = 0;
+    while(doomed[first]){
+        first++;
+    }
+    if(!journal_range(io, header_link_offset(io), io->offset_size) ||
+       !io_write_offset(io, header_link_offset(io), offsets[first]) || !io_sync(io)){
+        io_error(io, "Switching the header to the new IFD chain failed: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+static bool row_out_of_line(struct TiffIO *io, const struct BIGIFD *row){
+    return ifd_value_size(row->tag_type) * row->count > (uint64_t)io->offset_size;
+}
+
+/*
+ * Decode a table of rows to the BigTIFF shape. This is inlined with a
+ * constant row size, so each layout gets a loop of its own. Classic values
+ * held inline keep their bytes in the first four of the wider field, while
+ * offsets are widened as numbers.
+ */
+static inline void decode_rows(struct TiffIO *io, struct BIGIFD *rows, const uint8 *table, uint64_t row_count, const int row_size){
+    for(uint64_t i = 0; i < row_count; i++){
+        if(row_size == sizeof(struct BIGIFD)){
+            memcpy(&rows[i], table + i * row_size, sizeof(struct BIGIFD));
+            continue;
+        }
+        struct IFD row;
+        memcpy(&row, table + i * row_size, sizeof(struct IFD));
+        rows[i].tag = row.tag;
+        rows[i].tag_type = row.tag_type;
+        rows[i].count = (uint32)row.count;
+        rows[i].value = 0;
+        if(row_out_of_line(io, &rows[i])){
+            rows[i].value = row.value;
+        } else {
+            memcpy(&rows[i].value, &row.value, sizeof(uint32));
+        }
+    }
+}
+
+/*
+ * Read the rows of the IFD at offset in host order, widening classic rows
+ * to the BigTIFF layout so the rest of the code only has one shape to deal
+ * with.
+ */
+static struct BIGIFD *load_rows(struct TiffIO *io, off_t offset, uint64_t *row_count, off_t *next_offset){
+    uint64_t ifd_count = 0;
+    if(!io_read_count(io, offset, &ifd_count)){
+        return NULL;
+    }
+    void *scratch = NULL;
+    const uint8 *table = io_view_table(io, offset, ifd_count, &scratch);
+    if(table == NULL){
+        free(scratch);
+        return NULL;
+    }
+    struct BIGIFD *rows = malloc(sizeof(struct BIGIFD) * (ifd_count ? ifd_count : 1));
+    if(io->big_tiff){
+        decode_rows(io, rows, table, ifd_count, sizeof(struct BIGIFD));
+    } else {
+        decode_rows(io, rows, table, ifd_count, sizeof(struct IFD));
+    }
+    *next_offset = load_offset(io, table + io->ifd_row_size * ifd_count);
+    *row_count = ifd_count;
+    free(scratch);
+    // the values, tile arrays above all, are read next
+    for(uint64_t i = 0; io->cache && i < ifd_count; i++){
+        if(row_out_of_line(io, &rows[i])){
+            io_prefetch(io, rows[i].value, ifd_value_size(rows[i].tag_type) * rows[i].count);
+        }
+    }
+    return rows;
+}
+
+static uint64_t load_element(const uint8 *p, int width){
+    uint16 value16;
+    uint32 value32;
+    uint64_t value64;
+    switch(width){
+        case 2:
+            memcpy(&value16, p, sizeof(value16));
+            return value16;
+        case 4:
+            memcpy(&value32, p, sizeof(value32));
+            return value32;
+    }
+    memcpy(&value64, p, sizeof(value64));
+    return value64;
+}
+
+static void store_element(uint8 *p, int width, uint64_t value){
+    uint16 value16 = value;
+    uint32 value32 = value;
+    switch(width){
+        case 2:
+            memcpy(p, &value16, sizeof(value16));
+            return;
+        case 4:
+            memcpy(p, &value32, sizeof(value32));
+            return;
+    }
+    memcpy(p, &value, sizeof(value));
+}
+
+/*
+ * Decode elements first to first + count of an integer array such as
+ * StripOffsets or TileByteCounts into out, according to the type the row
+ * declares: SHORT, LONG or LONG8. The loops are kept separate per width so
+ * each one is a plain widening copy.
+ */
+static bool row_elements(struct TiffIO *io, const struct BIGIFD *row, uint64_t first, uint64_t count, uint64_t *out, void **scratch){
+    int width = ifd_value_size(row->tag_type);
+    if((width != 2 && width != 4 && width != 8) || row->count > (uint64_t)io->size || first + count > row->count){
+        return false;
+    }
+    const uint8 *p;
+    if(row_out_of_line(io, row)){
+        p = io_view_array(io, row->value + first * width, count, width, scratch);
+        if(p == NULL){
+            return false;
+        }
+    } else {
+        p = (const uint8 *)&row->value + first * width;
+    }
+    if(width == 2){
+        for(uint64_t i = 0; i < count; i++){
+            out[i] = load_element(p + i * 2, 2);
+        }
+    } else if(width == 4){
+        for(uint64_t i = 0; i < count; i++){
+            out[i] = load_element(p + i * 4, 4);
+        }
+    } else {
+        memcpy(out, p, count * sizeof(uint64_t));
+    }
+    return true;
+}
+
+/*
+ * Gather the tiles or strips referenced by a page. The offset and bytecount
+ * arrays are walked side by side ARRAY_CHUNK elements at a time, read in
+ * place from the mapping when there is one, so a level with hundreds of
+ * thousands of tiles needs no more memory than a small one.
+ */
+static bool gather_tiles(struct TiffIO *io, struct RangeList *clear, const struct BIGIFD *offset_row, const struct BIGIFD *size_row){
+    if(size_row == NULL || size_row->count != offset_row->count){
+        io_error(io, "Bad Tile offset/size row found");
+        return false;
+    }
+    if(DEBUG) printf("Found this many tilesizes: %llu\n", (unsigned long long)size_row->count);
+    uint64_t *addresses = malloc(2 * ARRAY_CHUNK * sizeof(uint64_t));
+    uint64_t *sizes = addresses + ARRAY_CHUNK;
+    void *address_scratch = NULL;
+    void *size_scratch = NULL;
+    bool ok = addresses != NULL;
+    for(uint64_t first = 0; ok && first < offset_row->count; first += ARRAY_CHUNK){
+        uint64_t chunk = offset_row->count - first < ARRAY_CHUNK ? offset_row->count - first : ARRAY_CHUNK;
+        if(!row_elements(io, offset_row, first, chunk, addresses, &address_scratch) ||
+           !row_elements(io, size_row, first, chunk, sizes, &size_scratch)){
+            io_error(io, "Tile offset/size arrays run past end of file");
+            ok = false;
+            break;
+        }
+        for(uint64_t i = 0; i < chunk; i++){
+            range_add(clear, addresses[i], sizes[i]);
+        }
+        ok = range_flush(io, clear);
+    }
+    free(addresses);
+    free(address_scratch);
+    free(size_scratch);
+    return ok;
+}
+
+/*
+ * The offset and bytecount rows of a page, tiles taking precedence over
+ * strips. Returns false when the page has neither.
+ */
+static bool find_tile_rows(struct BIGIFD rows[], uint64_t row_count, struct BIGIFD **offset_row, struct BIGIFD **size_row){
+    *offset_row = find_big_tag(rows, row_count, TIFFTAG_TILEOFFSETS);
+    *size_row = find_big_tag(rows, row_count, TIFFTAG_TILEBYTECOUNTS);
+    if(*offset_row == NULL){
+        *offset_row = find_big_tag(rows, row_count, TIFFTAG_STRIPOFFSETS);
+        *size_row = find_big_tag(rows, row_count, TIFFTAG_STRIPBYTECOUNTS);
+    }
+    return *offset_row != NULL;
+}
+
+/*
+ * Read the IFD at offset and return the offset of the next one, or -1 with
+ * an error set. When clear is given every range the page owns is added to
+ * it: the tile or strip data, out of line values and the table itself.
+ * Classic and BigTIFF files go through the same code, as load_rows has
+ * already put their rows in one shape.
+ */
+static off_t scan_page(struct TiffIO *io, off_t offset, int page_num, struct RangeList *clear){
+    if(clear == NULL){
+        // walking the chain only needs the next pointer
+        off_t link = ifd_link_offset(io, offset);
+        uint64_t next_offset = 0;
+        if(link < 0){
+            io_error(io, "IFD at 0x%llx lies outside the file", (unsigned long long)offset);
+            return -1;
+        }
+        if(!io_read(io, link, &next_offset, io->offset_size)){
+            io_error(io, "IFD at 0x%llx runs past end of file", (unsigned long long)offset);
+            return -1;
+        }
+        if(io->swap){
+            swap_array((uint8 *)&next_offset, 1, io->offset_size);
+        }
+        return next_offset;
+    }
+
+    uint64_t ifd_count;
+    off_t next_offset;
+    struct BIGIFD *ifds = load_rows(io, offset, &ifd_count, &next_offset);
+    if(ifds == NULL){
+        io_error(io, "IFD at 0x%llx runs past end of file", (unsigned long long)offset);
+        return -1;
+    }
+    if(DEBUG) printf("Image #%d\n", page_num);
+    if(DEBUG) printf("Found %llu IFDs\n", (unsigned long long)ifd_count);
+    for(uint64_t i = 0; i < ifd_count; i++){
+        if(DEBUG) printf("TAG: %d, Type: %d, Count: %llu, Value: %llu\n",
+               ifds[i].tag,
+               ifds[i].tag_type,
+               (unsigned long long)ifds[i].count,
+               (unsigned long long)ifds[i].value);
+    }
+    if(DEBUG) printf("Next Offset: 0x%llx\n", (unsigned long long)next_offset);
+
+    struct BIGIFD *offset_row;
+    struct BIGIFD *size_row;
+    if(find_tile_rows(ifds, ifd_count, &offset_row, &size_row) &&
+       !gather_tiles(io, clear, offset_row, size_row)){
+        free(ifds);
+        return -1;
+    }
+
+    // delete all off stored information
+    for(uint64_t i = 0; i < ifd_count; i++){
+        if(ifds[i].count > (uint64_t)io->size){
+            io_error(io, "Tag %d of IFD at 0x%llx has an impossible count", ifds[i].tag, (unsigned long long)offset);
+            free(ifds);
+            return -1;
+        }
+        if(row_out_of_line(io, &ifds[i])){
+            range_add(clear, ifds[i].value, ifds[i].count * ifd_value_size(ifds[i].tag_type));
+        }
+    }
+
+    if(DEBUG) printf("Deleting IFD table\n");
+    int64_t ifd_size = (io->ifd_row_size * ifd_count) + io->ifd_count_size + io->offset_size;
+    range_add(clear, offset, ifd_size);
+    free(ifds);
+    return next_offset;
+}
+
+/*
+ * Tags whose values point at other directories or at data without a
+ * bytecount. A rewrite has no way to relocate those, so it refuses.
+ */
+static const uint16 UNMOVABLE_TAGS[] = {
+    TIFFTAG_SUBIFD,
+    TIFFTAG_JPEGIFOFFSET,
+    TIFFTAG_EXIFIFD,
+    TIFFTAG_GPSIFD,
+    TIFFTAG_INTEROPERABILITYIFD,
+};
+
+static bool is_unmovable_tag(uint16 tag){
+    for(size_t i = 0; i < sizeof(UNMOVABLE_TAGS) / sizeof(UNMOVABLE_TAGS[0]); i++){
+        if(UNMOVABLE_TAGS[i] == tag){
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool is_offset_tag(uint16 tag){
+    return tag == TIFFTAG_STRIPOFFSETS || tag == TIFFTAG_TILEOFFSETS;
+}
+
+static int64_t align_word(int64_t size){
+    return (size + 1) & ~(int64_t)1;
+}
+
+/*
+ * Size of a page's directory in the output: the table followed by each
+ * out of line value, all kept on word boundaries.
+ */
+static int64_t ifd_block_size(struct TiffIO *io, struct BIGIFD *rows, uint64_t row_count){
+    int64_t size = align_word(io->ifd_count_size + io->ifd_row_size * row_count + io->offset_size);
+    for(uint64_t i = 0; i < row_count; i++){
+        if(row_out_of_line(io, &rows[i])){
+            size += align_word(ifd_value_size(rows[i].tag_type) * rows[i].count);
+        }
+    }
+    return size;
+}
+
+/*
+ * Where each surviving run of tile and strip data lands in the output.
+ * runs is sorted and merged, so a source offset is found by bisection and
+ * moves by the same amount as the run that holds it.
+ */
+struct Relocation {
+    struct RangeList runs;
+    off_t *targets;
+};
+
+static off_t relocate(struct Relocation *relocation, off_t offset){
+    size_t low = 0;
+    size_t high = relocation->runs.count;
+    while(low < high){
+        size_t middle = (low + high) / 2;
+        if(relocation->runs.items[middle].start <= offset){
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if(low == 0){
+        return offset;
+    }
+    struct Range *run = &relocation->runs.items[low - 1];
+    if(offset > run->start + run->size){
+        return offset;
+    }
+    return relocation->targets[low - 1] + (offset - run->start);
+}
+
+/*
+ * Move count offsets of width bytes, in host order, through the relocation.
+ */
+static void relocate_elements(struct Relocation *relocation, uint8 *p, uint64_t count, int width){
+    if(width != 2 && width != 4 && width != 8){
+        return;
+    }
+    for(uint64_t i = 0; i < count; i++){
+        store_element(p + i * width, width, relocate(relocation, load_element(p + i * width, width)));
+    }
+}
+
+/*
+ * Build the directory of a page as it will sit at base in the output. Out
+ * of line values are copied after the table and tile or strip offsets are
+ * moved through the relocation.
+ */
+static uint8 *build_ifd_block(struct TiffIO *io, struct BIGIFD *rows, uint64_t row_count,
+                       off_t base, off_t next_offset, struct Relocation *relocation, int64_t *block_size){
+    int64_t size = ifd_block_size(io, rows, row_count);
+    uint8 *block = calloc(1, size);
+    if(block == NULL){
+        return NULL;
+    }
+    memcpy(block, &row_count, io->ifd_count_size);
+    int64_t table_size = io->ifd_count_size + io->ifd_row_size * row_count;
+    memcpy(block + table_size, &next_offset, io->offset_size);
+    int64_t cursor = align_word(table_size + io->offset_size);
+    for(uint64_t i = 0; i < row_count; i++){
+        struct BIGIFD row = rows[i];
+        if(row_out_of_line(io, &row)){
+            int64_t value_size = ifd_value_size(row.tag_type) * row.count;
+            uint8 *value = block + cursor;
+            if(!io_read(io, row.value, value, value_size)){
+                free(block);
+                return NULL;
+            }
+            if(is_offset_tag(row.tag)){
+                int width = ifd_value_size(row.tag_type);
+                if(io->swap){
+                    swap_array(value, row.count, width);
+                }
+                relocate_elements(relocation, value, row.count, width);
+                if(io->swap){
+                    swap_array(value, row.count, width);
+                }
+            }
+            row.value = base + cursor;
+            cursor += align_word(value_size);
+        } else if(is_offset_tag(row.tag)){
+            relocate_elements(relocation, (uint8 *)&row.value, row.count, ifd_value_size(row.tag_type));
+        }
+        uint8 *slot = block + io->ifd_count_size + io->ifd_row_size * i;
+        if(io->big_tiff){
+            memcpy(slot, &row, sizeof(struct BIGIFD));
+        } else {
+            // the reverse of decode_rows
+            struct IFD narrow = {row.tag, row.tag_type, (int32)row.count, (uint32)row.value};
+            if(!row_out_of_line(io, &row)){
+                memcpy(&narrow.value, &row.value, sizeof(uint32));
+            }
+            memcpy(slot, &narrow, sizeof(struct IFD));
+        }
+    }
+    if(io->swap){
+        swap_array(block, 1, io->ifd_count_size);
+        swap_table(io, block + io->ifd_count_size, row_count, false);
+    }
+    *block_size = size;
+    return block;
+}
+
+/*
+ * Copy size bytes between files, letting the kernel move the data when it
+ * can: copy_file_range first, then sendfile, then plain reads and writes.
+ */
+static bool copy_range(struct TiffIO *io, off_t source, int out_fd, off_t target, int64_t size){
+    int in_fd = fileno(io->fp);
+#ifdef __linux__
+    bool kernel_copy = true;
+    while(size > 0 && kernel_copy){
+        off_t from = source;
+        ssize_t copied = copy_file_range(in_fd, &source, out_fd, &target, size, 0);
+        if(copied > 0){
+            // one call moves the bytes both ways
+            stats_read(io, from, copied, 0);
+            stats_write(io, -1, copied, 1);
+            size -= copied;
+        } else {
+            kernel_copy = false;
+        }
+    }
+    if(size > 0 && lseek(out_fd, target, SEEK_SET) == target){
+        while(size > 0){
+            off_t from = source;
+            ssize_t copied = sendfile(out_fd, in_fd, &source, size);
+            if(copied <= 0){
+                break;
+            }
+            stats_read(io, from, copied, 0);
+            stats_write(io, -1, copied, 1);
+            target += copied;
+            size -= copied;
+        }
+    }
+#endif
+    char *buffer = size > 0 ? malloc(BUFFER_SIZE) : NULL;
+    while(size > 0){
+        ssize_t chunk = buffer ? pread(in_fd, buffer, size > BUFFER_SIZE ? BUFFER_SIZE : size, source) : -1;
+        if(chunk <= 0 || pwrite(out_fd, buffer, chunk, target) != chunk){
+            free(buffer);
+            return false;
+        }
+        stats_read(io, source, chunk, 1);
+        stats_write(io, -1, chunk, 1);
+        source += chunk;
+        target += chunk;
+        size -= chunk;
+    }
+    free(buffer);
+    return true;
+}
+
+/*
+ * Write the pages still marked in keep[] to a new file. Tile and strip data
+ * is copied run by run in file order, then every directory is written after
+ * it with offsets rebased onto the new layout. With hoist the directories,
+ * out of line values and all, come first in one block right after the
+ * header, so a reader gets every page with one read.
+ */
+static int write_compacted(struct TiffIO *io, off_t offsets[], bool keep[], int page_count, const char *output, bool hoist){
+    struct stat in_stat, out_stat;
+    if(stat(output, &out_stat) == 0 && fstat(fileno(io->fp), &in_stat) == 0 &&
+       in_stat.st_dev == out_stat.st_dev && in_stat.st_ino == out_stat.st_ino){
+        io_error(io, "Output would overwrite the input file");
+        return 1;
+    }
+    // one of each per page, on the heap since a chain can be long
+    struct BIGIFD **rows = calloc(page_count, sizeof(struct BIGIFD *));
+    uint64_t *row_counts = calloc(page_count, sizeof(uint64_t));
+    off_t *bases = calloc(page_count, sizeof(off_t));
+    struct Relocation relocation = {{0}, NULL};
+    int status = 1;
+    int out_fd = -1;
+    if(page_count > 0 && (rows == NULL || row_counts == NULL || bases == NULL)){
+        io_error(io, "Out of memory for %d pages", page_count);
+        goto done;
+    }
+
+    // every run of data a surviving page points at
+    for(int i = 0; i < page_count; i++){
+        if(!keep[i]){
+            continue;
+        }
+        off_t next_offset;
+        rows[i] = load_rows(io, offsets[i], &row_counts[i], &next_offset);
+        if(rows[i] == NULL){
+            io_error(io, "IFD at 0x%llx runs past end of file", (unsigned long long)offsets[i]);
+            goto done;
+        }
+        struct BIGIFD *offset_row = NULL;
+        struct BIGIFD *size_row = NULL;
+        for(uint64_t j = 0; j < row_counts[i]; j++){
+            struct BIGIFD *row = &rows[i][j];
+            if(is_unmovable_tag(row->tag)){
+                io_error(io, "Page %d has tag %d pointing outside its own data, which can't be relocated", i + 1, row->tag);
+                goto done;
+            }
+            // as in scan_page, nothing in the file can be bigger than it
+            if(row->count > (uint64_t)io->size ||
+               (row_out_of_line(io, row) && ifd_value_size(row->tag_type) * row->count > (uint64_t)io->size)){
+                io_error(io, "Tag %d of IFD at 0x%llx has an impossible count", row->tag, (unsigned long long)offsets[i]);
+                goto done;
+            }
+            if(is_offset_tag(row->tag)){
+                offset_row = row;
+                size_row = find_big_tag(rows[i], row_counts[i], row->tag == TIFFTAG_TILEOFFSETS ? TIFFTAG_TILEBYTECOUNTS : TIFFTAG_STRIPBYTECOUNTS);
+                if(!gather_tiles(io, &relocation.runs, offset_row, size_row)){
+                    goto done;
+                }
+            }
+        }
+    }
+    range_coalesce(&relocation.runs);
+
+    // data goes straight after the header, keeping each run's word parity,
+    // then the directories in chain order; or the other way round
+    off_t cursor = io->big_tiff ? 16 : 8;
+    relocation.targets = malloc(sizeof(off_t) * (relocation.runs.count ? relocation.runs.count : 1));
+    for(int pass = 0; pass < 2; pass++){
+        if(hoist == (pass == 0)){
+            cursor = align_word(cursor);
+            for(int i = 0; i < page_count; i++){
+                if(keep[i]){
+                    bases[i] = cursor;
+                    cursor += ifd_block_size(io, rows[i], row_counts[i]);
+                }
+            }
+            continue;
+        }
+        for(size_t i = 0; i < relocation.runs.count; i++){
+            cursor += (relocation.runs.items[i].start - cursor) & 1;
+            relocation.targets[i] = cursor;
+            cursor += relocation.runs.items[i].size;
+        }
+    }
+    if(!io->big_tiff && cursor > UINT32_MAX){
+        io_error(io, "Output is too large for a classic tiff");
+        goto done;
+    }
+
+    out_fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(out_fd < 0){
+        io_error(io, "Opening output file failed");
+        goto done;
+    }
+    for(size_t i = 0; i < relocation.runs.count; i++){
+        if(!copy_range(io, relocation.runs.items[i].start, out_fd,
+                       relocation.targets[i], relocation.runs.items[i].size)){
+            io_error(io, "Copying tile data failed");
+            goto done;
+        }
+    }
+    off_t first_offset = 0;
+    for(int i = page_count - 1, next = -1; i >= 0; i--){
+        if(!keep[i]){
+            continue;
+        }
+        off_t next_offset = next >= 0 ? bases[next] : 0;
+        int64_t block_size;
+        uint8 *block = build_ifd_block(io, rows[i], row_counts[i], bases[i], next_offset, &relocation, &block_size);
+        if(block == NULL || pwrite(out_fd, block, block_size, bases[i]) != block_size){
+            io_error(io, "Writing IFD for page %d failed", i + 1);
+            free(block);
+            goto done;
+        }
+        stats_write(io, -1, block_size, 1);
+        free(block);
+        first_offset = bases[i];
+        next = i;
+    }
+
+    uint8 header[16] = {0};
+    int header_size = io->big_tiff ? 16 : 8;
+    if(!io_read(io, 0, header, header_size - io->offset_size)){
+        goto done;
+    }
+    memcpy(header + header_size - io->offset_size, &first_offset, io->offset_size);
+    if(io->swap){
+        swap_array(header + header_size - io->offset_size, 1, io->offset_size);
+    }
+    if(pwrite(out_fd, header, header_size, 0) != header_size){
+        io_error(io, "Writing output header failed");
+        goto done;
+    }
+    stats_write(io, -1, header_size, 1);
+    if(DEBUG) printf("Copied %zu runs, output is %lld bytes\n", relocation.runs.count, (long long)cursor);
+    status = 0;
+
+done:
+    if(out_fd >= 0 && close(out_fd) != 0){
+        status = 1;
+    }
+    for(int i = 0; rows && i < page_count; i++){
+        free(rows[i]);
+    }
+    free(rows);
+    free(row_counts);
+    free(bases);
+    range_free(&relocation.runs);
+    free(relocation.targets);
+    return status;
+}
+
+/*
+ * Parse a page list such as "2,4-6,-1" into the doomed[] flags.
+ * Pages are 1 indexed, negative numbers count back from the last page
+ * and either end of a range may be negative ("-3--1" is the last three).
+ */
+static int parse_page_spec(const char *spec, int page_count, bool doomed[]){
+    const char *p = spec;
+    while(*p){
+        char *end;
+        long first = strtol(p, &end, 10);
+        if(end == p){
+            return 1;
+        }
+        long last = first;
+        if(*end == '-'){
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if(end == p){
+                return 1;
+            }
+        }
+        if(*end != ',' && *end != '\0'){
+            return 1;
+        }
+        if(first < 0) first += page_count + 1;
+        if(last < 0) last += page_count + 1;
+        if(first < 1 || last > page_count || first > last){
+            return 1;
+        }
+        for(long i = first; i <= last; i++){
+            doomed[i - 1] = true;
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+    return 0;
+}
+
+/*
+ * Open a tiff and read its header, setting the layout for the rest of the
+ * session. On failure the reason is left in io->error.
+ */
+static bool read_header(struct TiffIO *io, off_t *first_offset){
+    struct Header header;
+    if(!io_read(io, 0, &header, sizeof(struct Header))){
+        io_error(io, "File too short for a tiff header");
+        return false;
+    }
+    off_t header_size = sizeof(struct Header);
+    io->swap = header.byte_order != HOST_BYTE_ORDER;
+    if(io->swap){
+        header.magic_number = __builtin_bswap16(header.magic_number);
+    }
+    if((header.byte_order != TIFF_LITTLEENDIAN && header.byte_order != TIFF_BIGENDIAN) ||
+       (header.magic_number != TIFF_VERSION_CLASSIC && header.magic_number != TIFF_VERSION_BIG)){
+        io_error(io, "Not a tiff file");
+        return false;
+    }
+    if (header.magic_number == TIFF_VERSION_BIG){
+        header_size += sizeof(struct BigHeader);
+        io_set_layout(io, true);
+    }
+    *first_offset = 0;
+    if(!io_read(io, header_size, first_offset, io->offset_size)){
+        io_error(io, "File too short for a tiff header");
+        return false;
+    }
+    if(io->swap){
+        swap_array((uint8 *)first_offset, 1, io->offset_size);
+    }
+    if(DEBUG) printf("BO: %x\nMN: %d\nOffset: 0x%llx\n", header.byte_order,
+           header.magic_number,
+           (unsigned long long)*first_offset);
+    if(DEBUG) printf("Offsetsize %d\n", io->offset_size);
+    if(DEBUG) printf("Using %s\n", io->map ? "mmap" : "stdio");
+    return true;
+}
+
+static bool open_tiff(struct TiffIO *io, const char *path, size_t read_block, bool writable, off_t *first_offset){
+    if(io_open(io, path, read_block, writable)){
+        io_error(io, "Opening file failed: %s", strerror(errno));
+        return false;
+    }
+    return read_header(io, first_offset);
+}
+
+/*
+ * Like open_tiff for a tiff arriving on in, spooling at most limit bytes
+ * (0 for the default) to a temporary file in $TMPDIR.
+ */
+static bool open_stream(struct TiffIO *io, struct Stream *stream, FILE *in, FILE *out, size_t limit, off_t *first_offset){
+    memset(io, 0, sizeof(struct TiffIO));
+    io->path = "stdin";
+    io_set_layout(io, false);
+    const char *dir = getenv("TMPDIR");
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/tiffsnip-XXXXXX", dir && *dir ? dir : "/tmp");
+    int fd = mkstemp(path);
+    if(fd < 0 || (io->fp = fdopen(fd, "w+b")) == NULL){
+        io_error(io, "Creating a spool file failed: %s", strerror(errno));
+        if(fd >= 0){
+            close(fd);
+        }
+        return false;
+    }
+    unlink(path);
+    *stream = (struct Stream){in, out, 0, limit ? limit : DEFAULT_SPOOL_LIMIT, false, false};
+    io->stream = stream;
+    io->size = INT64_MAX / 4;
+    return read_header(io, first_offset);
+}
+
+/*
+ * What --list reports about a page, read from its tag rows without touching
+ * any tile or strip data. Missing numeric tags are left at -1.
+ */
+struct PageInfo {
+    off_t offset;
+    int64_t width;
+    int64_t height;
+    bool tiled;
+    int64_t tile_width;
+    int64_t tile_length;
+    int64_t rows_per_strip;
+    int64_t compression;
+    int64_t subfile_type;
+    uint64_t tiles;
+    uint64_t bytes;
+    char *description;
+};
+
+/*
+ * The value of a single valued row, narrowed to the width of its type.
+ */
+static int64_t row_scalar(struct BIGIFD *row){
+    uint8 value8;
+    uint16 value16;
+    uint32 value32;
+    switch(row->tag_type){
+        case TIFF_BYTE:
+        case TIFF_SBYTE:
+        case TIFF_UNDEFINED:
+            memcpy(&value8, &row->value, sizeof(value8));
+            return value8;
+        case TIFF_SHORT:
+        case TIFF_SSHORT:
+            memcpy(&value16, &row->value, sizeof(value16));
+            return value16;
+        case TIFF_LONG:
+        case TIFF_SLONG:
+        case TIFF_IFD:
+            memcpy(&value32, &row->value, sizeof(value32));
+            return value32;
+    }
+    return row->value;
+}
+
+static int64_t tag_scalar(struct BIGIFD rows[], uint64_t row_count, uint16 tag){
+    struct BIGIFD *row = find_big_tag(rows, row_count, tag);
+    return row && row->count > 0 ? row_scalar(row) : -1;
+}
+
+/*
+ * Copy the bytes of a row's value, wherever it lives, into a new buffer
+ * with a terminating nul.
+ */
+static char *row_bytes(struct TiffIO *io, struct BIGIFD *row){
+    int64_t size = ifd_value_size(row->tag_type) * row->count;
+    char *bytes = malloc(size + 1);
+    if(row_out_of_line(io, row)){
+        if(!io_read(io, row->value, bytes, size)){
+            free(bytes);
+            return NULL;
+        }
+    } else {
+        memcpy(bytes, &row->value, size);
+    }
+    bytes[size] = '\0';
+    return bytes;
+}
+
+static bool describe_page(struct TiffIO *io, off_t offset, struct PageInfo *info, off_t *next_offset){
+    uint64_t row_count;
+    struct BIGIFD *rows = load_rows(io, offset, &row_count, next_offset);
+    if(rows == NULL){
+        io_error(io, "IFD at 0x%llx runs past end of file", (unsigned long long)offset);
+        return false;
+    }
+    memset(info, 0, sizeof(struct PageInfo));
+    info->offset = offset;
+    info->width = tag_scalar(rows, row_count, TIFFTAG_IMAGEWIDTH);
+    info->height = tag_scalar(rows, row_count, TIFFTAG_IMAGELENGTH);
+    info->tile_width = tag_scalar(rows, row_count, TIFFTAG_TILEWIDTH);
+    info->tile_length = tag_scalar(rows, row_count, TIFFTAG_TILELENGTH);
+    info->rows_per_strip = tag_scalar(rows, row_count, TIFFTAG_ROWSPERSTRIP);
+    info->compression = tag_scalar(rows, row_count, TIFFTAG_COMPRESSION);
+    info->subfile_type = tag_scalar(rows, row_count, TIFFTAG_SUBFILETYPE);
+    struct BIGIFD *description = find_big_tag(rows, row_count, TIFFTAG_IMAGEDESCRIPTION);
+    if(description){
+        info->description = row_bytes(io, description);
+    }
+
+    info->tiled = find_big_tag(rows, row_count, TIFFTAG_TILEOFFSETS) != NULL;
+    struct BIGIFD *size_row = find_big_tag(rows, row_count, info->tiled ? TIFFTAG_TILEBYTECOUNTS : TIFFTAG_STRIPBYTECOUNTS);
+    bool ok = true;
+    if(size_row){
+        info->tiles = size_row->count;
+        void *scratch = NULL;
+        uint64_t *sizes = malloc(ARRAY_CHUNK * sizeof(uint64_t));
+        for(uint64_t first = 0; first < size_row->count; first += ARRAY_CHUNK){
+            uint64_t chunk = size_row->count - first < ARRAY_CHUNK ? size_row->count - first : ARRAY_CHUNK;
+            if(sizes == NULL || !row_elements(io, size_row, first, chunk, sizes, &scratch)){
+                io_error(io, "Tile bytecount array of IFD at 0x%llx runs past end of file", (unsigned long long)offset);
+                ok = false;
+                break;
+            }
+            for(uint64_t i = 0; i < chunk; i++){
+                info->bytes += sizes[i];
+            }
+        }
+        free(sizes);
+        free(scratch);
+    }
+    free(rows);
+    return ok;
+}
+
+static void free_page_infos(struct PageInfo *infos, int page_count){
+    for(int i = 0; infos && i < page_count; i++){
+        free(infos[i].description);
+    }
+    free(infos);
+}
+
+static void print_json_string(FILE *out, const char *text){
+    fputc('"', out);
+    for(const unsigned char *p = (const unsigned char *)text; *p; p++){
+        if(*p == '"' || *p == '\\'){
+            fprintf(out, "\\%c", *p);
+        } else if(*p == '\n'){
+            fputs("\\n", out);
+        } else if(*p == '\t'){
+            fputs("\\t", out);
+        } else if(*p < 0x20 || *p >= 0x7f){
+            fprintf(out, "\\u%04x", *p);
+        } else {
+            fputc(*p, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static void print_json_number(FILE *out, const char *name, int64_t value){
+    if(value < 0){
+        fprintf(out, ",\"%s\":null", name);
+    } else {
+        fprintf(out, ",\"%s\":%lld", name, (long long)value);
+    }
+}
+
+// a tag the page doesn't have is a dash in text
+static void print_text_number(FILE *out, const char *before, int64_t value){
+    if(value < 0){
+        fprintf(out, "%s-", before);
+    } else {
+        fprintf(out, "%s%lld", before, (long long)value);
+    }
+}
+
+static void print_page(FILE *out, int page_num, struct PageInfo *info, bool json){
+    if(json){
+        fprintf(out, "{\"page\":%d,\"offset\":%lld", page_num, (long long)info->offset);
+        print_json_number(out, "width", info->width);
+        print_json_number(out, "height", info->height);
+        fprintf(out, ",\"layout\":\"%s\"", info->tiled ? "tiles" : "strips");
+        print_json_number(out, "tile_width", info->tile_width);
+        print_json_number(out, "tile_length", info->tile_length);
+        print_json_number(out, "rows_per_strip", info->rows_per_strip);
+        print_json_number(out, "compression", info->compression);
+        print_json_number(out, "subfile_type", info->subfile_type);
+        fprintf(out, ",\"tiles\":%llu,\"bytes\":%llu,\"description\":",
+                (unsigned long long)info->tiles, (unsigned long long)info->bytes);
+        if(info->description){
+            print_json_string(out, info->description);
+        } else {
+            fputs("null", out);
+        }
+        fputc('}', out);
+        return;
+    }
+    fprintf(out, "Page %d: ", page_num);
+    print_text_number(out, "", info->width);
+    print_text_number(out, "x", info->height);
+    if(info->tiled){
+        fprintf(out, ", %llu tiles of ", (unsigned long long)info->tiles);
+        print_text_number(out, "", info->tile_width);
+        print_text_number(out, "x", info->tile_length);
+    } else {
+        fprintf(out, ", %llu strips of ", (unsigned long long)info->tiles);
+        print_text_number(out, "", info->rows_per_strip);
+        fputs(" rows", out);
+    }
+    fprintf(out, ", %llu bytes", (unsigned long long)info->bytes);
+    print_text_number(out, ", compression ", info->compression);
+    print_text_number(out, ", subfile type ", info->subfile_type);
+    if(info->description){
+        fputs(", ", out);
+        print_json_string(out, info->description);
+    }
+    fputc('\n', out);
+}
+
+/*
+ * Walk the chain once, returning where every page lives. When infos is
+ * given each page is also described as it is passed.
+ */
+static off_t *walk_chain(struct TiffIO *io, off_t first_offset, int *page_count, struct PageInfo **infos){
+    off_t *offsets = NULL;
+    int capacity = 0;
+    off_t next_offset = first_offset;
+    *page_count = 0;
+    if(infos){
+        *infos = NULL;
+    }
+    while (next_offset > 0) {
+        for(int i = 0; i < *page_count; i++){
+            if(offsets[i] == next_offset){
+                io_error(io, "IFD chain loops back on itself");
+                goto failed;
+            }
+        }
+        if(*page_count == capacity){
+            capacity = capacity ? capacity * 2 : 16;
+            offsets = realloc(offsets, capacity * sizeof(off_t));
+            if(infos){
+                *infos = realloc(*infos, capacity * sizeof(struct PageInfo));
+            }
+        }
+        offsets[*page_count] = next_offset;
+        *page_count += 1;
+        if(infos){
+            if(!describe_page(io, next_offset, &(*infos)[*page_count - 1], &next_offset)){
+                *page_count -= 1;
+                goto failed;
+            }
+        } else {
+            next_offset = scan_page(io, next_offset, *page_count, NULL);
+        }
+        if(next_offset < 0){
+            goto failed;
+        }
+        if(next_offset > 0 && io->cache){
+            io_prefetch(io, next_offset, io->cache->block_size);
+        }
+    }
+    return offsets;
+
+failed:
+    if(infos){
+        free_page_infos(*infos, *page_count);
+        *infos = NULL;
+    }
+    free(offsets);
+    return NULL;
+}
+
+static const struct {
+    const char *name;
+    enum TiffsnipField field;
+} PREDICATE_FIELDS[] = {
+    {"description", TIFFSNIP_FIELD_DESCRIPTION},
+    {"desc", TIFFSNIP_FIELD_DESCRIPTION},
+    {"subfile", TIFFSNIP_FIELD_SUBFILE},
+    {"width", TIFFSNIP_FIELD_WIDTH},
+    {"height", TIFFSNIP_FIELD_HEIGHT},
+    {"compression", TIFFSNIP_FIELD_COMPRESSION},
+    {"tiles", TIFFSNIP_FIELD_TILES},
+    {"bytes", TIFFSNIP_FIELD_BYTES},
+};
+
+/*
+ * Parse field, operator and value. Operators are ~ (contains, ignoring
+ * case, descriptions only), = and != for both kinds of field, and < <= >
+ * >= & (any of these bits set) for numbers.
+ */
+int tiffsnip_parse_predicate(const char *text, struct TiffsnipPredicate *predicate){
+    size_t name_length = strcspn(text, "~=!<>&");
+    const char *op = text + name_length;
+    if(*op == '\0'){
+        return 1;
+    }
+    bool found = false;
+    for(size_t i = 0; i < sizeof(PREDICATE_FIELDS) / sizeof(PREDICATE_FIELDS[0]); i++){
+        if(strlen(PREDICATE_FIELDS[i].name) == name_length && strncmp(PREDICATE_FIELDS[i].name, text, name_length) == 0){
+            predicate->field = PREDICATE_FIELDS[i].field;
+            found = true;
+        }
+    }
+    size_t op_length = (op[1] == '=') ? 2 : 1;
+    memset(predicate->op, 0, sizeof(predicate->op));
+    memcpy(predicate->op, op, op_length);
+    predicate->text = op + op_length;
+    if(!found || (strcmp(predicate->op, "!") == 0)){
+        return 1;
+    }
+    if(predicate->field == TIFFSNIP_FIELD_DESCRIPTION){
+        return strcmp(predicate->op, "~") && strcmp(predicate->op, "=") && strcmp(predicate->op, "!=");
+    }
+    char *end;
+    predicate->number = strtoll(predicate->text, &end, 0);
+    return end == predicate->text || *end != '\0' || strcmp(predicate->op, "~") == 0;
+}
+
+static bool contains_ignoring_case(const char *haystack, const char *needle){
+    size_t length = strlen(needle);
+    for(; *haystack; haystack++){
+        if(strncasecmp(haystack, needle, length) == 0){
+            return true;
+        }
+    }
+    return length == 0;
+}
+
+static bool predicate_matches(const struct TiffsnipPredicate *predicate, const struct PageInfo *info){
+    const char *op = predicate->op;
+    if(predicate->field == TIFFSNIP_FIELD_DESCRIPTION){
+        if(info->description == NULL){
+            return false;
+        }
+        if(strcmp(op, "~") == 0){
+            return contains_ignoring_case(info->description, predicate->text);
+        }
+        return (strcmp(info->description, predicate->text) == 0) == (strcmp(op, "=") == 0);
+    }
+    int64_t value;
+    switch(predicate->field){
+        case TIFFSNIP_FIELD_SUBFILE: value = info->subfile_type; break;
+        case TIFFSNIP_FIELD_WIDTH: value = info->width; break;
+        case TIFFSNIP_FIELD_HEIGHT: value = info->height; break;
+        case TIFFSNIP_FIELD_COMPRESSION: value = info->compression; break;
+        case TIFFSNIP_FIELD_TILES: value = info->tiles; break;
+        default: value = info->bytes; break;
+    }
+    if(value < 0){
+        // the tag is missing, which never matches
+        return false;
+    }
+    int64_t number = predicate->number;
+    if(strcmp(op, "=") == 0) return value == number;
+    if(strcmp(op, "!=") == 0) return value != number;
+    if(strcmp(op, "<") == 0) return value < number;
+    if(strcmp(op, "<=") == 0) return value <= number;
+    if(strcmp(op, ">") == 0) return value > number;
+    if(strcmp(op, ">=") == 0) return value >= number;
+    return (value & number) != 0;
+}
+
+/*
+ * An open file and its IFD chain, walked once when it is opened and again
+ * only after the chain is changed in place. Every operation on the file
+ * reuses the walk, the range lists and the journal held here.
+ */
+struct Tiffsnip {
+    struct TiffIO io;
+    struct TiffsnipOptions options;
+    bool writable;
+    // -1 when the file could not be opened or walked
+    int page_count;
+    off_t *offsets;
+    // tags of each page, read on first need
+    struct PageInfo *infos;
+    // whether pages were cleared through this handle, and which ranges
+    bool snipped;
+    struct RangeList cleared;
+    struct RangeList keep;
+    struct RangeList clear;
+    struct Journal journal;
+    struct SnipStats stats;
+    struct Stream stream;
+};
+
+static size_t options_read_block(const struct TiffsnipOptions *options){
+    if(options->use_mmap){
+        return 0;
+    }
+    return options->read_block ? options->read_block : DEFAULT_READ_BLOCK;
+}
+
+static bool read_first_offset(struct TiffIO *io, off_t *first_offset){
+    *first_offset = 0;
+    if(!io_read(io, header_link_offset(io), first_offset, io->offset_size)){
+        io_error(io, "File too short for a tiff header");
+        return false;
+    }
+    if(io->swap){
+        swap_array((uint8 *)first_offset, 1, io->offset_size);
+    }
+    return true;
+}
+
+/*
+ * Walk the chain from the header, describing every page on the way when
+ * the options will need their tags.
+ */
+static bool walk_pages(struct Tiffsnip *snip){
+    off_t first_offset;
+    free_page_infos(snip->infos, snip->page_count);
+    free(snip->offsets);
+    snip->infos = NULL;
+    snip->offsets = NULL;
+    snip->page_count = -1;
+    bool describe = snip->options.list || snip->options.predicate_count;
+    int page_count;
+    enum Phase previous = stats_phase(&snip->io, PHASE_WALK);
+    bool walked = read_first_offset(&snip->io, &first_offset) &&
+                  (snip->offsets = walk_chain(&snip->io, first_offset, &page_count, describe ? &snip->infos : NULL));
+    stats_phase(&snip->io, previous);
+    if(!walked){
+        return false;
+    }
+    snip->page_count = page_count;
+    return true;
+}
+
+static bool describe_pages(struct Tiffsnip *snip){
+    stats_phase(&snip->io, PHASE_WALK);
+    struct PageInfo *infos = calloc(snip->page_count ? snip->page_count : 1, sizeof(struct PageInfo));
+    for(int i = 0; infos && i < snip->page_count; i++){
+        off_t next_offset;
+        if(!describe_page(&snip->io, snip->offsets[i], &infos[i], &next_offset)){
+            free_page_infos(infos, i + 1);
+            return false;
+        }
+    }
+    snip->infos = infos;
+    return infos != NULL;
+}
+
+/*
+ * A plan is a snip worked out but not carried out, written with --plan and
+ * carried out later with --apply. It is plain text, one record per line:
+ *
+ *   tiffsnip plan 1
+ *   file <path>
+ *   size <bytes>
+ *   fingerprint <hex>
+ *   remove <pages>
+ *   meta <offset> <size>    bytes the plan was worked out from
+ *   link <offset> <value>   pointer rewrites, in the order they are made
+ *   clear <offset> <size>   ranges to clear, sorted and merged
+ *
+ * Offsets are hex. The fingerprint hashes the file size and every meta
+ * range, which covers the header and the IFDs and arrays of every page, so
+ * --apply can tell the file has changed without walking it again.
+ */
+#define PLAN_VERSION 1
+
+/*
+ * The header and every IFD table and out of line value of a page, the
+ * bytes a plan depends on.
+ */
+static bool gather_metadata(struct TiffIO *io, off_t offset, struct RangeList *meta){
+    uint64_t row_count;
+    off_t next_offset;
+    struct BIGIFD *rows = load_rows(io, offset, &row_count, &next_offset);
+    if(rows == NULL){
+        io_error(io, "IFD at 0x%llx runs past end of file", (unsigned long long)offset);
+        return false;
+    }
+    range_add(meta, offset, io->ifd_count_size + io->ifd_row_size * row_count + io->offset_size);
+    for(uint64_t i = 0; i < row_count; i++){
+        if(row_out_of_line(io, &rows[i]) && rows[i].count <= (uint64_t)io->size){
+            range_add(meta, rows[i].value, rows[i].count * ifd_value_size(rows[i].tag_type));
+        }
+    }
+    free(rows);
+    return true;
+}
+
+/*
+ * 64-bit FNV-1a over the file size and the meta ranges.
+ */
+static bool file_fingerprint(struct TiffIO *io, struct RangeList *meta, uint64_t *fingerprint){
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    uint64_t size = io->size;
+    for(int i = 0; i < 8; i++){
+        hash = (hash ^ ((size >> (8 * i)) & 0xff)) * 0x100000001b3ULL;
+    }
+    void *scratch = NULL;
+    for(size_t i = 0; i < meta->count; i++){
+        const uint8 *bytes = io_view(io, meta->items[i].start, meta->items[i].size, &scratch);
+        if(bytes == NULL){
+            free(scratch);
+            return false;
+        }
+        for(int64_t j = 0; j < meta->items[i].size; j++){
+            hash = (hash ^ bytes[j]) * 0x100000001b3ULL;
+        }
+    }
+    free(scratch);
+    *fingerprint = hash;
+    return true;
+}
+
+static bool write_plan(struct TiffIO *io, const char *plan, bool doomed[], int page_count, struct RangeList *meta,
+                struct Link links[], int link_count, struct RangeList *clear){
+    uint64_t fingerprint;
+    if(!file_fingerprint(io, meta, &fingerprint)){
+        io_error(io, "Reading the file for its fingerprint failed");
+        return false;
+    }
+    FILE *fp = strcmp(plan, "-") == 0 ? stdout : fopen(plan, "w");
+    if(fp == NULL){
+        io_error(io, "Opening plan %s failed: %s", plan, strerror(errno));
+        return false;
+    }
+    // the plan may well be applied from somewhere else
+    char *path = realpath(io->path, NULL);
+    fprintf(fp, "tiffsnip plan %d\nfile %s\nsize %lld\nfingerprint %016llx\nremove",
+            PLAN_VERSION, path ? path : io->path, (long long)io->size, (unsigned long long)fingerprint);
+    free(path);
+    for(int i = 0, first = 1; i < page_count; i++){
+        if(doomed[i]){
+            fprintf(fp, "%s%d", first ? " " : ",", i + 1);
+            first = 0;
+        }
+    }
+    fputc('\n', fp);
+    for(size_t i = 0; i < meta->count; i++){
+        fprintf(fp, "meta 0x%llx %lld\n", (unsigned long long)meta->items[i].start, (long long)meta->items[i].size);
+    }
+    for(int i = 0; i < link_count; i++){
+        fprintf(fp, "link 0x%llx 0x%llx\n", (unsigned long long)links[i].offset, (unsigned long long)links[i].value);
+    }
+    for(size_t i = 0; i < clear->count; i++){
+        fprintf(fp, "clear 0x%llx %lld\n", (unsigned long long)clear->items[i].start, (long long)clear->items[i].size);
+    }
+    bool ok = !ferror(fp);
+    if(fp != stdout && fclose(fp) != 0){
+        ok = false;
+    }
+    if(!ok){
+        io_error(io, "Writing plan %s failed", plan);
+    }
+    return ok;
+}
+
+/*
+ * Carry out the plan at plan_path on the file it names, which is returned
+ * in target for the caller to free.
+ */
+static int apply_plan(struct TiffIO *io, const struct TiffsnipOptions *options, const char *plan_path,
+               struct RangeList *cleared, char **target){
+    FILE *fp = strcmp(plan_path, "-") == 0 ? stdin : fopen(plan_path, "r");
+    if(fp == NULL){
+        io_error(io, "Opening plan %s failed: %s", plan_path, strerror(errno));
+        return 1;
+    }
+    int status = 1;
+    int version = 0;
+    long long size = -1;
+    unsigned long long fingerprint = 0;
+    bool fingerprinted = false;
+    struct RangeList meta = {0};
+    struct RangeList clear = {0};
+    struct Link *links = NULL;
+    int link_count = 0;
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t length;
+    *target = NULL;
+    while((length = getline(&line, &line_size, fp)) != -1){
+        if(length > 0 && line[length - 1] == '\n'){
+            line[--length] = '\0';
+        }
+        unsigned long long start, value;
+        long long range_size;
+        if(sscanf(line, "tiffsnip plan %d", &version) == 1 ||
+           sscanf(line, "size %lld", &size) == 1 ||
+           strncmp(line, "remove", 6) == 0){
+            continue;
+        } else if(strncmp(line, "file ", 5) == 0){
+            free(*target);
+            *target = strdup(line + 5);
+        } else if(sscanf(line, "fingerprint %llx", &fingerprint) == 1){
+            fingerprinted = true;
+        } else if(sscanf(line, "meta %llx %lld", &start, &range_size) == 2){
+            range_add(&meta, start, range_size);
+        } else if(sscanf(line, "link %llx %llx", &start, &value) == 2){
+            links = realloc(links, (link_count + 1) * sizeof(struct Link));
+            links[link_count].offset = start;
+            links[link_count++].value = value;
+        } else if(sscanf(line, "clear %llx %lld", &start, &range_size) == 2){
+            range_add(&clear, start, range_size);
+        } else if(length > 0){
+            io_error(io, "Bad line in plan %s: %s", plan_path, line);
+            goto done;
+        }
+    }
+    if(version != PLAN_VERSION || *target == NULL || size < 0 || !fingerprinted){
+        io_error(io, "%s is not a tiffsnip plan", plan_path);
+        goto done;
+    }
+
+    // only the header is read, to learn the byte order and offset width
+    off_t first_offset;
+    struct TiffsnipRing *ring = io->ring;
+    struct Journal *journal = io->journal;
+    struct SnipStats *stats = io->stats;
+    bool opened = open_tiff(io, *target, options_read_block(options), true, &first_offset);
+    io->ring = ring;
+    io->journal = journal;
+    io->stats = stats;
+    io->punch = options->punch;
+    io->random_passes = options->random_passes;
+    io->final_zero = options->final_zero;
+    io->log = options->log;
+    io->cleared = cleared;
+    if(!opened){
+        goto done;
+    }
+    uint64_t actual;
+    stats_phase(io, PHASE_WALK);
+    if(io->size != size || !file_fingerprint(io, &meta, &actual) || actual != fingerprint){
+        io_error(io, "%s has changed since the plan was made, refusing to apply it", *target);
+        goto done;
+    }
+    if(io->journal && !journal_open(io)){
+        goto done;
+    }
+    if(!clear_ranges(io, &clear)){
+        io_error(io, "Writing zeros failed: %s", strerror(errno));
+        goto done;
+    }
+    if(!write_links(io, links, link_count)){
+        io_error(io, "Relinking the IFD chain failed");
+        goto done;
+    }
+    status = 0;
+
+done:
+    io->cleared = NULL;
+    if(fp != stdin){
+        fclose(fp);
+    }
+    free(line);
+    free(links);
+    range_free(&meta);
+    range_free(&clear);
+    return status;
+}
+
+/*
+ * Read the range record at the journal's position, unpacking its bytes and
+ * checking them against its crc.
+ */
+static bool read_journal_record(FILE *fp, uint8 *packed, uint8 *bytes, off_t *offset, int64_t *size){
+    uint8 record[29];
+    if(fread(record, 1, sizeof(record), fp) != sizeof(record) || record[0] != 'R'){
+        return false;
+    }
+    *offset = load_le(record + 1, 8);
+    *size = load_le(record + 9, 8);
+    uint64_t packed_size = load_le(record + 17, 8);
+    if(*size > JOURNAL_CHUNK || packed_size > PACKED_SIZE(JOURNAL_CHUNK) ||
+       fread(packed, 1, packed_size, fp) != packed_size || !unpack_bits(packed, packed_size, bytes, *size)){
+        return false;
+    }
+    uint32 crc = crc32_update(crc32_update(0, record, 25), bytes, *size);
+    return crc == load_le(record + 25, 4);
+}
+
+/*
+ * Put back everything the journal at journal_path recorded, newest record
+ * first, and cut the file back to its size before the snip. The whole
+ * journal is checked before anything is written, and once the file is
+ * restored and synced the journal is removed, since replaying it after a
+ * later snip would undo part of that too. The restored file is returned
+ * in target for the caller to free.
+ */
+static int restore_journal(struct TiffIO *io, const struct TiffsnipOptions *options, const char *journal_path, char **target){
+    FILE *fp = fopen(journal_path, "rb");
+    if(fp == NULL){
+        io_error(io, "Opening journal %s failed: %s", journal_path, strerror(errno));
+        return 1;
+    }
+    int status = 1;
+    int version = 0;
+    long long size = -1;
+    char *line = NULL;
+    size_t line_size = 0;
+    off_t *records = NULL;
+    uint64_t record_count = 0;
+    uint8 *packed = malloc(PACKED_SIZE(JOURNAL_CHUNK));
+    uint8 *bytes = malloc(JOURNAL_CHUNK);
+    off_t offset;
+    int64_t range_size;
+    *target = NULL;
+    for(int i = 0; i < 3 && getline(&line, &line_size, fp) > 0; i++){
+        line[strcspn(line, "\n")] = '\0';
+        if(strncmp(line, "file ", 5) == 0){
+            free(*target);
+            *target = strdup(line + 5);
+        } else if(sscanf(line, "tiffsnip journal %d", &version) != 1 && sscanf(line, "size %lld", &size) != 1){
+            break;
+        }
+    }
+    if(version != JOURNAL_VERSION || *target == NULL || size < 0 || packed == NULL || bytes == NULL){
+        io_error(io, "%s is not a tiffsnip journal", journal_path);
+        goto done;
+    }
+
+    bool ended = false;
+    for(;;){
+        off_t at = ftello(fp);
+        uint8 record[13];
+        if(fread(record, 1, 1, fp) != 1){
+            break;
+        }
+        if(record[0] == 'E'){
+            ended = fread(record + 1, 1, 12, fp) == 12 && load_le(record + 1, 8) == record_count &&
+                    load_le(record + 9, 4) == crc32_update(0, record, 9);
+            break;
+        }
+        fseeko(fp, at, SEEK_SET);
+        if(!read_journal_record(fp, packed, bytes, &offset, &range_size)){
+            break;
+        }
+        if(record_count % 1024 == 0){
+            records = realloc(records, (record_count + 1024) * sizeof(off_t));
+        }
+        records[record_count++] = at;
+    }
+    if(!ended){
+        io_error(io, "Journal %s is damaged or incomplete, nothing was restored", journal_path);
+        goto done;
+    }
+
+    struct SnipStats *stats = io->stats;
+    if(io_open(io, *target, options_read_block(options), true)){
+        io_error(io, "Opening %s failed: %s", *target, strerror(errno));
+        goto done;
+    }
+    io->stats = stats;
+    stats_phase(io, PHASE_OTHER);
+    if(io->size < size){
+        io_error(io, "%s is smaller than when it was snipped, refusing to restore it", *target);
+        goto done;
+    }
+    for(uint64_t i = record_count; i-- > 0;){
+        fseeko(fp, records[i], SEEK_SET);
+        if(!read_journal_record(fp, packed, bytes, &offset, &range_size) ||
+           !io_write(io, offset, bytes, range_size)){
+            io_error(io, "Restoring 0x%llx of %s failed", (long long)offset, *target);
+            goto done;
+        }
+    }
+    if(DEBUG) printf("Restored %llu records\n", (unsigned long long)record_count);
+    // anything --atomic appended goes
+    if(!io_sync(io) || (io->size > size && ftruncate(fileno(io->fp), size) != 0)){
+        io_error(io, "Restoring %s failed: %s", *target, strerror(errno));
+        goto done;
+    }
+    if(unlink(journal_path) != 0){
+        io_error(io, "%s was restored but removing journal %s failed: %s", *target, journal_path, strerror(errno));
+        goto done;
+    }
+    status = 0;
+
+done:
+    fclose(fp);
+    free(line);
+    free(records);
+    free(packed);
+    free(bytes);
+    return status;
+}
+
+/*
+ * Pages being split out of one file into a file each, shared by a few
+ * threads that each open the input for themselves.
+ */
+struct Split {
+    const char *path;
+    const struct TiffsnipOptions *options;
+    off_t *offsets;
+    bool *selected;
+    int page_count;
+    const char *dir;
+    int next_page;
+    int failures;
+    // room for the page number ahead of its error
+    char error[512];
+    pthread_mutex_t lock;
+};
+
+/*
+ * dir/slide-3.svs for page 3 of some/where/slide.svs.
+ */
+static void split_name(const char *path, const char *dir, int page_num, char *name, size_t name_size){
+    const char *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    const char *extension = strrchr(base, '.');
+    if(extension == NULL || extension == base){
+        extension = base + strlen(base);
+    }
+    snprintf(name, name_size, "%s/%.*s-%d%s", dir, (int)(extension - base), base, page_num, extension);
+}
+
+static void *split_worker(void *arg){
+    struct Split *split = arg;
+    bool *keep = calloc(split->page_count, sizeof(bool));
+    char name[4096];
+    if(keep == NULL && split->page_count > 0){
+        pthread_mutex_lock(&split->lock);
+        if(split->failures++ == 0){
+            snprintf(split->error, sizeof(split->error), "out of memory for %d pages", split->page_count);
+        }
+        pthread_mutex_unlock(&split->lock);
+        return NULL;
+    }
+    for(;;){
+        pthread_mutex_lock(&split->lock);
+        while(split->next_page < split->page_count && !split->selected[split->next_page]){
+            split->next_page++;
+        }
+        int page = split->next_page++;
+        pthread_mutex_unlock(&split->lock);
+        if(page >= split->page_count){
+            free(keep);
+            return NULL;
+        }
+        struct TiffIO io;
+        off_t first_offset;
+        int status = 1;
+        memset(keep, 0, split->page_count * sizeof(bool));
+        keep[page] = true;
+        split_name(split->path, split->dir, page + 1, name, sizeof(name));
+        if(open_tiff(&io, split->path, options_read_block(split->options), false, &first_offset)){
+            status = write_compacted(&io, split->offsets, keep, split->page_count, name, split->options->hoist);
+        }
+        if(io.fp){
+            io_close(&io);
+        }
+        if(DEBUG) printf("Page %d to %s: %s\n", page + 1, name, status ? io.error : "ok");
+        if(status){
+            pthread_mutex_lock(&split->lock);
+            if(split->failures++ == 0){
+                snprintf(split->error, sizeof(split->error), "page %d: %s", page + 1, io.error);
+            }
+            pthread_mutex_unlock(&split->lock);
+        }
+    }
+}
+
+/*
+ * Write each selected page to its own file in dir, several at once.
+ */
+static int split_pages(struct TiffIO *io, const struct TiffsnipOptions *options, off_t offsets[], bool selected[],
+                int page_count, const char *dir){
+    struct Split split = {io->path, options, offsets, selected, page_count, dir, 0, 0, "", PTHREAD_MUTEX_INITIALIZER};
+    int selected_count = 0;
+    for(int i = 0; i < page_count; i++){
+        if(selected[i]) selected_count++;
+    }
+    int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if(jobs > selected_count){
+        jobs = selected_count;
+    }
+    if(jobs < 1){
+        jobs = 1;
+    }
+    pthread_t workers[jobs];
+    int started = 0;
+    for(int i = 0; i < jobs; i++){
+        if(pthread_create(&workers[started], NULL, split_worker, &split) == 0){
+            started += 1;
+        }
+    }
+    if(started == 0){
+        split_worker(&split);
+    }
+    for(int i = 0; i < started; i++){
+        pthread_join(workers[i], NULL);
+    }
+    if(split.failures){
+        io_error(io, "%d of %d pages failed, %s", split.failures, selected_count, split.error);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Write a streamed tiff to its output as it was laid out, with the ranges
+ * in clear, which must be sorted, zeroed and the links rewritten: first
+ * the spooled bytes, then the rest of the input as it arrives.
+ */
+static bool write_stream(struct TiffIO *io, struct Link links[], int link_count, const struct RangeList *clear){
+    struct Stream *stream = io->stream;
+    uint8 *buffer = malloc(BUFFER_SIZE);
+    off_t at = 0;
+    size_t next = 0;
+    while(buffer){
+        size_t got;
+        if(at < stream->spooled){
+            got = stream->spooled - at < BUFFER_SIZE ? stream->spooled - at : BUFFER_SIZE;
+            if(pread(fileno(io->fp), buffer, got, at) != (ssize_t)got){
+                break;
+            }
+            stats_read(io, -1, got, 1);
+        } else {
+            got = fread(buffer, 1, BUFFER_SIZE, stream->in);
+            stats_read(io, -1, got, 1);
+            if(got == 0){
+                free(buffer);
+                return !ferror(stream->in) && fflush(stream->out) == 0;
+            }
+        }
+        off_t end = at + got;
+        while(next < clear->count && clear->items[next].start + clear->items[next].size <= at){
+            next++;
+        }
+        for(size_t i = next; i < clear->count && clear->items[i].start < end; i++){
+            off_t start = clear->items[i].start > at ? clear->items[i].start : at;
+            off_t stop = clear->items[i].start + clear->items[i].size < end ? clear->items[i].start + clear->items[i].size : end;
+            memset(buffer + (start - at), 0, stop - start);
+        }
+        // a link may straddle two buffers, so it goes in a byte at a time
+        for(int i = 0; i < link_count; i++){
+            uint64_t value = links[i].value;
+            if(io->swap){
+                swap_array((uint8 *)&value, 1, io->offset_size);
+            }
+            for(int j = 0; j < io->offset_size; j++){
+                if(links[i].offset + j >= at && links[i].offset + j < end){
+                    buffer[links[i].offset + j - at] = ((uint8 *)&value)[j];
+                }
+            }
+        }
+        if(fwrite(buffer, 1, got, stream->out) != got){
+            break;
+        }
+        stats_write(io, -1, got, 1);
+        at = end;
+    }
+    free(buffer);
+    return false;
+}
+
+/*
+ * The body of snip_pages, with doomed and links sized for the page count.
+ */
+static int snip_selected(struct Tiffsnip *snip, const char *pages, const char *output, bool extract,
+                bool doomed[], struct Link links[]){
+    struct TiffIO *io = &snip->io;
+    const struct TiffsnipOptions *options = &snip->options;
+    int page_count = snip->page_count;
+    off_t *offsets = snip->offsets;
+    if(io->stream && (output || options->plan || options->atomic)){
+        io_error(io, "A streamed file can only be snipped to its output");
+        return 1;
+    }
+    if(output == NULL && options->plan == NULL && !snip->writable && io->stream == NULL){
+        io_error(io, "File was opened read only");
+        return 1;
+    }
+    if(pages == NULL && options->predicate_count && snip->infos == NULL && !describe_pages(snip)){
+        return 1;
+    }
+
+    if(pages == NULL){
+        pages = options->page_spec;
+    }
+    if(pages && parse_page_spec(pages, page_count, doomed)){
+        io_error(io, "Bad page list '%s' for a file with %d pages", pages, page_count);
+        return 1;
+    }
+    // predicates are tested against the pages described by the walk
+    for(int i = 0; pages == options->page_spec && i < page_count; i++){
+        for(int j = 0; j < options->predicate_count && !doomed[i]; j++){
+            doomed[i] = predicate_matches(&options->predicates[j], &snip->infos[i]);
+        }
+        if(DEBUG && doomed[i]) printf("Page %d selected\n", i + 1);
+    }
+    int survivors = 0;
+    for(int i = 0; i < page_count; i++){
+        if(!doomed[i]) survivors += 1;
+    }
+    if(extract && survivors == page_count){
+        io_error(io, "No pages selected to extract");
+        return 1;
+    }
+    if(survivors == 0 && !extract){
+        io_error(io, "Refusing to delete every page");
+        return 1;
+    }
+
+    if(output){
+        bool *keep = malloc(page_count * sizeof(bool));
+        if(keep == NULL && page_count > 0){
+            io_error(io, "Out of memory for %d pages", page_count);
+            return 1;
+        }
+        for(int i = 0; i < page_count; i++){
+            keep[i] = extract ? doomed[i] : !doomed[i];
+        }
+        stats_phase(io, PHASE_COPY);
+        int status = options->split ? split_pages(io, options, offsets, keep, page_count, output) :
+                     write_compacted(io, offsets, keep, page_count, output, options->hoist);
+        free(keep);
+        return status;
+    }
+
+    // the handle's lists are reused from call to call
+    struct RangeList *keep = &snip->keep;
+    struct RangeList *clear = &snip->clear;
+    keep->count = 0;
+    clear->count = 0;
+    int link_count = 0;
+    if(options->plan == NULL && io->journal && io->journal->fp == NULL && !journal_open(io)){
+        return 1;
+    }
+    // with --atomic the survivors get a new chain up front instead, and their
+    // old tables are cleared along with the doomed pages
+    stats_phase(io, PHASE_RELINK);
+    if(options->atomic && options->plan == NULL){
+        if(!append_chain(io, offsets, doomed, page_count, clear)){
+            return 1;
+        }
+    } else if((link_count = plan_links(io, offsets, doomed, page_count, links)) < 0){
+        io_error(io, "IFD at the end of the new chain lies outside the file");
+        return 1;
+    }
+    // cleared ranges are kept for a later tiffsnip_verify, unless the memory
+    // limit says not to, when it checks every unreferenced byte instead
+    snip->snipped = options->plan == NULL && io->stream == NULL && (options->verify || options->mem_limit == 0);
+
+    // everything the survivors still reference, so that data shared with a
+    // doomed page, such as JPEGTables or deduplicated blank tiles, survives
+    stats_phase(io, PHASE_KEEP);
+    for(int i = 0; i < page_count; i++){
+        if(!doomed[i] && scan_page(io, offsets[i], i + 1, keep) < 0){
+            return 1;
+        }
+    }
+    range_coalesce(keep);
+    if(DEBUG) printf("Surviving pages reference %zu ranges\n", keep->count);
+
+    if(io->stream){
+        stats_phase(io, PHASE_GATHER);
+        for(int i = 0; i < page_count; i++){
+            if(doomed[i] && scan_page(io, offsets[i], i + 1, clear) < 0){
+                return 1;
+            }
+        }
+        size_t gathered = clear->count;
+        range_coalesce(clear);
+        size_t coalesced = clear->count;
+        range_subtract(clear, keep);
+        stats_ranges(io, gathered, coalesced, clear);
+        stats_phase(io, PHASE_COPY);
+        if(!write_stream(io, links, link_count, clear)){
+            io_error(io, "Writing the snipped stream failed: %s", strerror(errno));
+            return 1;
+        }
+        return 0;
+    }
+
+    stats_phase(io, PHASE_GATHER);
+    if(options->plan){
+        struct RangeList meta = {0};
+        bool planned = true;
+        range_add(&meta, 0, io->big_tiff ? 16 : 8);
+        for(int i = 0; i < page_count && planned; i++){
+            planned = gather_metadata(io, offsets[i], &meta) &&
+                      (!doomed[i] || scan_page(io, offsets[i], i + 1, clear) >= 0);
+        }
+        if(planned){
+            range_coalesce(&meta);
+            range_coalesce(clear);
+            range_subtract(clear, keep);
+            planned = write_plan(io, options->plan, doomed, page_count, &meta, links, link_count, clear);
+        }
+        range_free(&meta);
+        return planned ? 0 : 1;
+    }
+
+    // only the doomed ranges can be given back early, the index has to be
+    // whole for the clearing to be safe
+    io->range_limit = 0;
+    if(options->mem_limit){
+        // the chunk buffers and the per page arrays come out of the allowance first
+        size_t arrays = 2 * ARRAY_CHUNK * sizeof(uint64_t) +
+                        (size_t)page_count * (sizeof(off_t) + sizeof(bool) + sizeof(struct Link)) +
+                        (options->atomic ? (size_t)page_count * sizeof(int64_t) : 0);
+        size_t ranges = options->mem_limit > arrays ? (options->mem_limit - arrays) / sizeof(struct Range) : 0;
+        io->range_limit = ranges > 256 ? ranges : 256;
+    }
+
+    // set before the scan, since the memory limit can clear ranges early
+    io->keep = keep;
+    io->cleared = snip->snipped ? &snip->cleared : NULL;
+    bool scanned = true;
+    for(int i = 0; i < page_count && scanned; i++){
+        if(doomed[i]){
+            scanned = scan_page(io, offsets[i], i + 1, clear) >= 0;
+        }
+    }
+    bool zeroed = scanned && clear_ranges(io, clear);
+    io->keep = NULL;
+    io->cleared = NULL;
+    io->range_limit = 0;
+    if(!scanned){
+        return 1;
+    }
+    if(!zeroed){
+        io_error(io, "Writing zeros failed: %s", strerror(errno));
+        return 1;
+    }
+
+    // forward each survivor to the next survivor
+    if(!write_links(io, links, link_count)){
+        io_error(io, "Relinking the IFD chain failed");
+        return 1;
+    }
+    // and take the new chain from the file, which also shows it is whole
+    return walk_pages(snip) ? 0 : 1;
+}
+
+/*
+ * Snip the selected pages from the file in place, or write the survivors to
+ * output, or with extract write the selected pages to output instead. The
+ * pages are those in pages, or when it is NULL the ones the options pick.
+ * The handle's chain is walked again after an in place snip.
+ */
+static int snip_pages(struct Tiffsnip *snip, const char *pages, const char *output, bool extract){
+    if(snip->page_count < 0){
+        return 1;
+    }
+    // on the heap, since the page count comes from the file
+    bool *doomed = calloc(snip->page_count, sizeof(bool));
+    struct Link *links = malloc((snip->page_count + 1) * sizeof(struct Link));
+    int status = 1;
+    if((doomed == NULL && snip->page_count > 0) || links == NULL){
+        io_error(&snip->io, "Out of memory for %d pages", snip->page_count);
+    } else {
+        status = snip_selected(snip, pages, output, extract, doomed, links);
+    }
+    free(doomed);
+    free(links);
+    return status;
+}
+
+/*
+ * Print one record per page using nothing but the chain walk and the tag
+ * rows, as text or as a single JSON line for the file.
+ */
+static int list_pages(struct Tiffsnip *snip, FILE *report){
+    struct TiffIO *io = &snip->io;
+    if(snip->page_count < 0 || (snip->infos == NULL && !describe_pages(snip))){
+        return 1;
+    }
+    bool json = snip->options.json;
+    if(json){
+        fputs("{\"file\":", report);
+        print_json_string(report, io->path);
+        fprintf(report, ",\"bigtiff\":%s,\"pages\":[", io->big_tiff ? "true" : "false");
+    }
+    for(int i = 0; i < snip->page_count; i++){
+        if(json && i > 0){
+            fputc(',', report);
+        }
+        print_page(report, i + 1, &snip->infos[i], json);
+    }
+    if(json){
+        fputs("]}\n", report);
+    }
+    return 0;
+}
+
+/*
+ * Check a file for --verify: the IFD chain must be well formed, every page
+ * must only reference bytes inside the file, no page may reference a
+ * cleared byte and every cleared byte must read as zero. The ranges this
+ * handle cleared are checked when it has snipped the file; otherwise, as
+ * when checking a file snipped earlier, everything neither the header nor
+ * any page references counts as cleared.
+ */
+static int verify_pages(struct Tiffsnip *snip, FILE *report){
+    struct TiffIO *io = &snip->io;
+    int page_count = snip->page_count;
+    off_t *offsets = snip->offsets;
+    if(page_count < 0){
+        return 1;
+    }
+    stats_phase(io, PHASE_VERIFY);
+    int status = 1;
+    struct RangeList *cleared = snip->snipped ? &snip->cleared : NULL;
+    struct RangeList *referenced = &snip->keep;
+    struct RangeList gaps = {0};
+    referenced->count = 0;
+    range_add(referenced, 0, io->big_tiff ? 16 : 8);
+    if(cleared){
+        range_coalesce(cleared);
+    }
+    struct RangeList own = {0};
+    for(int i = 0; i < page_count; i++){
+        off_t at;
+        own.count = 0;
+        if(scan_page(io, offsets[i], i + 1, &own) < 0){
+            goto done;
+        }
+        range_coalesce(&own);
+        if(own.count && own.items[own.count - 1].start + own.items[own.count - 1].size > io->size){
+            io_error(io, "Page %d references bytes past the end of the file", i + 1);
+            goto done;
+        }
+        if(cleared && range_intersects(&own, cleared, &at)){
+            io_error(io, "Page %d still references cleared bytes at 0x%llx", i + 1, (unsigned long long)at);
+            goto done;
+        }
+        for(size_t j = 0; j < own.count; j++){
+            range_add(referenced, own.items[j].start, own.items[j].size);
+        }
+    }
+    range_coalesce(referenced);
+    if(cleared == NULL){
+        range_complement(referenced, io->size, &gaps);
+        cleared = &gaps;
+    }
+
+    uint64_t checked = 0;
+    for(size_t i = 0; i < cleared->count; i++){
+        off_t at;
+        if(!range_is_zero(io, cleared->items[i].start, cleared->items[i].size, &at)){
+            if(at < 0){
+                io_error(io, "Reading cleared bytes at 0x%llx failed", (unsigned long long)cleared->items[i].start);
+            } else {
+                io_error(io, "Cleared bytes are not zero at 0x%llx", (unsigned long long)at);
+            }
+            goto done;
+        }
+        checked += cleared->items[i].size;
+    }
+    if(snip->options.json){
+        fputs("{\"file\":", report);
+        print_json_string(report, io->path);
+        fprintf(report, ",\"verified\":true,\"pages\":%d,\"cleared_ranges\":%zu,\"cleared_bytes\":%llu}\n",
+                page_count, cleared->count, (unsigned long long)checked);
+    } else {
+        fprintf(report, "verified %d pages, %llu cleared bytes in %zu ranges are zero\n",
+                page_count, (unsigned long long)checked, cleared->count);
+    }
+    status = 0;
+
+done:
+    range_free(&own);
+    range_free(&gaps);
+    return status;
+}
+
+/*
+ * Say how many reads reached the device for a file opened without a
+ * mapping.
+ */
+static void print_read_report(struct TiffIO *io, FILE *out){
+    struct BlockCache *cache = io->cache;
+    if(cache == NULL || io->fp == NULL){
+        return;
+    }
+    fprintf(out, "%s: %llu device reads, %.1f KiB, %llu cache hits, %llu readahead hints, blocks up to %zu KiB\n",
+            io->path, (unsigned long long)cache->device_reads, cache->device_bytes / 1024.0,
+            (unsigned long long)cache->hits, (unsigned long long)cache->hints, cache->largest_block / 1024);
+}
+
+/*
+ * Write a byte count the short way, such as 4K or 16M.
+ */
+static void print_size(FILE *out, uint64_t size){
+    const char *units = "KMGTPE";
+    int unit = -1;
+    while(size >= 1024 && size % 1024 == 0 && units[unit + 1]){
+        size /= 1024;
+        unit++;
+    }
+    fprintf(out, "%llu", (unsigned long long)size);
+    if(unit >= 0){
+        fputc(units[unit], out);
+    }
+}
+
+static void print_stats(FILE *out, struct TiffIO *io, bool json){
+    struct SnipStats *stats = io->stats;
+    stats_phase(io, stats->phase);
+    double total = stats->since - stats->started;
+    if(json){
+        fputs("{\"file\":", out);
+        print_json_string(out, io->path);
+        fprintf(out, ",\"seconds\":{\"total\":%.6f", total);
+        for(int i = 0; i < PHASE_COUNT; i++){
+            fprintf(out, ",\"%s\":%.6f", PHASE_NAMES[i], stats->seconds[i]);
+        }
+        fprintf(out, "},\"read_bytes\":%llu,\"read_calls\":%llu,\"written_bytes\":%llu,\"write_calls\":%llu,"
+                "\"other_calls\":%llu,\"seeks\":%llu,\"ranges_gathered\":%llu,\"ranges_coalesced\":%llu,"
+                "\"ranges_cleared\":%llu,\"cleared_bytes\":%llu,\"range_sizes\":{",
+                (unsigned long long)stats->read_bytes, (unsigned long long)stats->read_calls,
+                (unsigned long long)stats->written_bytes, (unsigned long long)stats->write_calls,
+                (unsigned long long)stats->other_calls, (unsigned long long)stats->seeks,
+                (unsigned long long)stats->ranges_gathered, (unsigned long long)stats->ranges_coalesced,
+                (unsigned long long)stats->ranges_cleared, (unsigned long long)stats->cleared_bytes);
+        // keyed by the least size in each bucket
+        const char *separator = "";
+        for(int i = 0; i < SIZE_BUCKETS; i++){
+            if(stats->range_sizes[i]){
+                fprintf(out, "%s\"%llu\":%llu", separator, 1ULL << i, (unsigned long long)stats->range_sizes[i]);
+                separator = ",";
+            }
+        }
+        fputs("}}\n", out);
+        return;
+    }
+    fprintf(out, "%s: %.3f s", io->path, total);
+    for(int i = 0; i < PHASE_COUNT; i++){
+        if(stats->seconds[i] >= 0.0005){
+            fprintf(out, ", %s %.3f", PHASE_NAMES[i], stats->seconds[i]);
+        }
+    }
+    fprintf(out, "\n  read %.1f KiB in %llu calls, wrote %.1f KiB in %llu calls, %llu other calls, %llu seeks\n",
+            stats->read_bytes / 1024.0, (unsigned long long)stats->read_calls, stats->written_bytes / 1024.0,
+            (unsigned long long)stats->write_calls, (unsigned long long)stats->other_calls,
+            (unsigned long long)stats->seeks);
+    if(stats->ranges_gathered == 0){
+        return;
+    }
+    fprintf(out, "  %llu ranges gathered, %llu after coalescing, %llu cleared holding %.1f KiB\n  sizes:",
+            (unsigned long long)stats->ranges_gathered, (unsigned long long)stats->ranges_coalesced,
+            (unsigned long long)stats->ranges_cleared, stats->cleared_bytes / 1024.0);
+    for(int i = 0; i < SIZE_BUCKETS; i++){
+        if(stats->range_sizes[i]){
+            fputc(' ', out);
+            print_size(out, 1ULL << i);
+            fprintf(out, "+ %llu", (unsigned long long)stats->range_sizes[i]);
+        }
+    }
+    fputc('\n', out);
+}
+
+/*
+ * Print a file's stats in one write, so workers' reports don't interleave.
+ */
+static void report_stats(struct TiffIO *io, bool json, FILE *out){
+    if(io->stats == NULL){
+        return;
+    }
+    char *text = NULL;
+    size_t text_size = 0;
+    FILE *buffer = open_memstream(&text, &text_size);
+    if(buffer == NULL){
+        return;
+    }
+    print_stats(buffer, io, json);
+    fclose(buffer);
+    fputs(text, out);
+    free(text);
+}
+
+/*
+ * End an operation on the handle, saying so when a streamed file needed
+ * more spooled than it was allowed, whatever the failing read reported.
+ */
+static int operation_done(struct Tiffsnip *snip, int status){
+    struct Stream *stream = snip->io.stream;
+    if(stream && stream->overflowed){
+        io_error(&snip->io, "Reaching every IFD and array needs more than %lld bytes of the stream spooled",
+                 (long long)stream->limit);
+    }
+    stats_phase(&snip->io, PHASE_OTHER);
+    return status;
+}
+
+/*
+ * Open path and walk its chain. A handle comes back even when that fails,
+ * so the reason can be read from it; only running out of memory gives
+ * NULL. The handle takes its own copy of options.
+ */
+struct Tiffsnip *tiffsnip_open(const char *path, const struct TiffsnipOptions *options, bool writable, struct TiffsnipRing *ring){
+    struct Tiffsnip *snip = calloc(1, sizeof(struct Tiffsnip));
+    if(snip == NULL){
+        return NULL;
+    }
+    snip->options = *options;
+    snip->writable = writable;
+    snip->page_count = -1;
+    snip->journal.dir = options->journal;
+    if(options->stats){
+        stats_start(&snip->stats);
+    }
+    off_t first_offset;
+    if(!open_tiff(&snip->io, path, options_read_block(options), writable, &first_offset)){
+        return snip;
+    }
+    // the header read isn't counted, only the time opening took
+    snip->io.stats = options->stats ? &snip->stats : NULL;
+    snip->io.ring = ring;
+    snip->io.punch = options->punch;
+    snip->io.random_passes = options->random_passes;
+    snip->io.final_zero = options->final_zero;
+    snip->io.log = options->log;
+    snip->io.journal = options->journal ? &snip->journal : NULL;
+    walk_pages(snip);
+    return snip;
+}
+
+/*
+ * Like tiffsnip_open for a tiff arriving on a pipe such as stdin, which
+ * tiffsnip_delete writes to out as it is read. The input can only be gone
+ * through once, so one list or delete is all the handle allows.
+ */
+struct Tiffsnip *tiffsnip_open_stream(FILE *in, FILE *out, const struct TiffsnipOptions *options){
+    struct Tiffsnip *snip = calloc(1, sizeof(struct Tiffsnip));
+    if(snip == NULL){
+        return NULL;
+    }
+    snip->options = *options;
+    snip->page_count = -1;
+    if(options->stats){
+        stats_start(&snip->stats);
+    }
+    off_t first_offset;
+    if(open_stream(&snip->io, &snip->stream, in, out, options->spool_limit, &first_offset)){
+        snip->io.stats = options->stats ? &snip->stats : NULL;
+        walk_pages(snip);
+    }
+    operation_done(snip, 0);
+    return snip;
+}
+
+const char *tiffsnip_error(const struct Tiffsnip *snip){
+    return snip ? snip->io.error : "Out of memory";
+}
+
+int tiffsnip_page_count(const struct Tiffsnip *snip){
+    return snip ? snip->page_count : -1;
+}
+
+int tiffsnip_list(struct Tiffsnip *snip, FILE *report){
+    return operation_done(snip, list_pages(snip, report));
+}
+
+/*
+ * Remove pages from the file, or with output write the others to a new
+ * file. pages is a list such as "2,4-6", or NULL for the options' pages
+ * and predicates.
+ */
+int tiffsnip_delete(struct Tiffsnip *snip, const char *pages, const char *output){
+    return operation_done(snip, snip_pages(snip, pages, output, false));
+}
+
+/*
+ * Write pages to output, leaving the file alone.
+ */
+int tiffsnip_extract(struct Tiffsnip *snip, const char *pages, const char *output){
+    return operation_done(snip, snip_pages(snip, pages, output, true));
+}
+
+int tiffsnip_verify(struct Tiffsnip *snip, FILE *report){
+    if(snip == NULL){
+        return 1;
+    }
+    if(snip->io.stream){
+        io_error(&snip->io, "A streamed file can't be verified");
+        return 1;
+    }
+    return operation_done(snip, verify_pages(snip, report));
+}
+
+void tiffsnip_print_stats(struct Tiffsnip *snip, FILE *out){
+    if(snip && snip->options.read_report){
+        print_read_report(&snip->io, out);
+    }
+    if(snip){
+        report_stats(&snip->io, snip->options.json, out);
+    }
+}
+
+/*
+ * Close the file and end its journal, copying the reason to error when
+ * either fails, and free the handle.
+ */
+int tiffsnip_close(struct Tiffsnip *snip, char *error, size_t error_size){
+    if(snip == NULL){
+        return 0;
+    }
+    struct TiffIO *io = &snip->io;
+    int status = 0;
+    if(io->fp && io_close(io) != 0){
+        io_error(io, "Closing file failed: %s", strerror(errno));
+        status = 1;
+    }
+    if(!journal_close(&snip->journal)){
+        io_error(io, "Writing journal %s failed: %s", snip->journal.path, strerror(snip->journal.error));
+        status = 1;
+    }
+    if(status && error){
+        snprintf(error, error_size, "%s", io->error);
+    }
+    free_page_infos(snip->infos, snip->page_count);
+    free(snip->offsets);
+    range_free(&snip->cleared);
+    range_free(&snip->keep);
+    range_free(&snip->clear);
+    free(snip);
+    return status;
+}
+
+/*
+ * Carry out a plan or replay a journal, then verify the file they name
+ * against what was written when asked to.
+ */
+static int replay_file(const char *path, const struct TiffsnipOptions *options, struct TiffsnipRing *ring,
+                FILE *report, char *error, size_t error_size){
+    struct TiffIO io;
+    memset(&io, 0, sizeof(struct TiffIO));
+    io.path = path;
+    io.ring = ring;
+    struct Journal journal = {.dir = options->journal};
+    if(options->journal){
+        io.journal = &journal;
+    }
+    struct SnipStats stats;
+    if(options->stats){
+        stats_start(&stats);
+        io.stats = &stats;
+    }
+    struct RangeList cleared = {0};
+    char *target = NULL;
+    int status = options->restore ? restore_journal(&io, options, path, &target) :
+                 apply_plan(&io, options, path, options->verify ? &cleared : NULL, &target);
+    if(options->read_report && options->log){
+        print_read_report(&io, options->log);
+    }
+    if(io.fp && options->log){
+        report_stats(&io, options->json, options->log);
+    }
+    if(io.fp && io_close(&io) != 0 && status == 0){
+        io_error(&io, "Closing file failed: %s", strerror(errno));
+        status = 1;
+    }
+    if(!journal_close(&journal)){
+        io_error(&io, "Writing journal %s failed: %s", journal.path, strerror(journal.error));
+        status = 1;
+    }
+    if(status){
+        snprintf(error, error_size, "%s", io.error);
+    } else if(options->verify){
+        struct Tiffsnip *snip = tiffsnip_open(target, options, false, NULL);
+        if(snip){
+            // checked against what the plan cleared
+            snip->snipped = true;
+            snip->cleared = cleared;
+            cleared = (struct RangeList){0};
+        }
+        status = tiffsnip_verify(snip, report);
+        if(status){
+            snprintf(error, error_size, "%s", tiffsnip_error(snip));
+        }
+        if(options->log){
+            tiffsnip_print_stats(snip, options->log);
+        }
+        tiffsnip_close(snip, NULL, 0);
+    }
+    range_free(&cleared);
+    free(target);
+    return status;
+}
+
+/*
+ * Snip one file, or list or verify it, as the options say. Everything lives
+ * in this call's handles, so it is safe to run on several threads at once.
+ * Listings go to report and on failure the reason is copied to error.
+ */
+int tiffsnip_file(const char *path, const struct TiffsnipOptions *options, const char *output, struct TiffsnipRing *ring,
+                  FILE *report, char *error, size_t error_size){
+    if(options->apply || options->restore){
+        return replay_file(path, options, ring, report, error, error_size);
+    }
+    // --hoist rewrites a file even with no pages to snip
+    bool snipping = options->page_spec || options->predicate_count || options->hoist;
+    bool writable = snipping && output == NULL && options->plan == NULL;
+    struct Tiffsnip *snip = tiffsnip_open(path, options, writable, ring);
+    int status = tiffsnip_page_count(snip) < 0;
+    if(status == 0 && options->list){
+        status = tiffsnip_list(snip, report);
+    } else if(status == 0 && snipping){
+        status = options->extract ? tiffsnip_extract(snip, NULL, output) : tiffsnip_delete(snip, NULL, output);
+    }
+    // a new copy is checked as a whole, an edited file against what was cleared
+    if(status == 0 && options->verify && !options->list && output){
+        if(options->log){
+            tiffsnip_print_stats(snip, options->log);
+        }
+        if(tiffsnip_close(snip, error, error_size)){
+            return 1;
+        }
+        snip = tiffsnip_open(output, options, false, NULL);
+        status = tiffsnip_page_count(snip) < 0;
+    }
+    if(status == 0 && options->verify && !options->list){
+        status = tiffsnip_verify(snip, report);
+    }
+    if(status){
+        snprintf(error, error_size, "%s", tiffsnip_error(snip));
+    }
+    if(options->log){
+        tiffsnip_print_stats(snip, options->log);
+    }
+    return tiffsnip_close(snip, status ? NULL : error, error_size) || status;
+}
+
+struct TiffsnipRing *tiffsnip_ring_create(void){
+    return ring_create();
+}
+
+void tiffsnip_ring_print_stats(const struct TiffsnipRing *ring, FILE *out){
+    ring_print_stats(ring, out);
+}
+
+void tiffsnip_ring_destroy(struct TiffsnipRing *ring){
+    ring_destroy(ring);
+}
+
+void tiffsnip_print_json_string(FILE *out, const char *text){
+    print_json_string(out, text);
+}
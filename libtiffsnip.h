@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2019 Joseph Utecht
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * libtiffsnip: remove, extract and verify pages of tiff files in place.
+ *
+ * A file is opened once with tiffsnip_open, which reads the header and walks
+ * the IFD chain; tiffsnip_list, tiffsnip_delete, tiffsnip_extract and
+ * tiffsnip_verify then work from that walk and reuse the handle's buffers.
+ * Nothing is shared between handles, so each thread can have its own.
+ * Functions returning int give 0 on success, and on failure the reason can
+ * be read with tiffsnip_error until the handle is closed.
+ */
+#ifndef LIBTIFFSNIP_H
+#define LIBTIFFSNIP_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define TIFFSNIP_API __attribute__((visibility("default")))
+
+// largest starting block for the read cache
+#define TIFFSNIP_MAX_READ_BLOCK (4 * 1024 * 1024)
+
+/*
+ * A metadata test for --where, such as description~label or subfile&1.
+ * Pages matching any predicate are snipped along with any --pages.
+ */
+enum TiffsnipField {
+    TIFFSNIP_FIELD_DESCRIPTION,
+    TIFFSNIP_FIELD_SUBFILE,
+    TIFFSNIP_FIELD_WIDTH,
+    TIFFSNIP_FIELD_HEIGHT,
+    TIFFSNIP_FIELD_COMPRESSION,
+    TIFFSNIP_FIELD_TILES,
+    TIFFSNIP_FIELD_BYTES,
+};
+
+struct TiffsnipPredicate {
+    enum TiffsnipField field;
+    char op[3];
+    const char *text;
+    int64_t number;
+};
+
+struct TiffsnipOptions {
+    const char *page_spec;
+    bool use_mmap;
+    bool punch;
+    bool uring;
+    bool list;
+    bool json;
+    struct TiffsnipPredicate *predicates;
+    int predicate_count;
+    // heap working memory allowed per file, 0 for no limit
+    size_t mem_limit;
+    bool verify;
+    // write what would be done here instead of doing it
+    const char *plan;
+    // the files given are plans to carry out
+    bool apply;
+    // record what is overwritten in this directory so it can be restored
+    const char *journal;
+    // the files given are journals to replay
+    bool restore;
+    // switch to a new chain with one header write before clearing anything
+    bool atomic;
+    // output gets the selected pages rather than the others
+    bool extract;
+    // and is a directory with a file for each page
+    bool split;
+    // output has every IFD in one block after the header
+    bool hoist;
+    // report how many device reads each file took
+    bool read_report;
+    // report the time, calls and ranges each file took, on stderr
+    bool stats;
+    // random passes laid over removed data before it is zeroed, each made
+    // durable, and whether the zeros still follow them
+    int random_passes;
+    bool final_zero;
+    // most of a streamed file spooled while its IFDs are found, 0 for 256M
+    size_t spool_limit;
+    // starting block size of the read cache used when not mapping
+    size_t read_block;
+    // notices, such as punching falling back to zeros, and the stats and
+    // read reports tiffsnip_file makes go here, or nowhere when NULL
+    FILE *log;
+};
+
+// an io_uring shared by the handles one thread opens
+struct TiffsnipRing;
+struct Tiffsnip;
+
+TIFFSNIP_API struct Tiffsnip *tiffsnip_open(const char *path, const struct TiffsnipOptions *options, bool writable,
+                                            struct TiffsnipRing *ring);
+TIFFSNIP_API struct Tiffsnip *tiffsnip_open_stream(FILE *in, FILE *out, const struct TiffsnipOptions *options);
+TIFFSNIP_API const char *tiffsnip_error(const struct Tiffsnip *snip);
+TIFFSNIP_API int tiffsnip_page_count(const struct Tiffsnip *snip);
+TIFFSNIP_API int tiffsnip_list(struct Tiffsnip *snip, FILE *report);
+TIFFSNIP_API int tiffsnip_delete(struct Tiffsnip *snip, const char *pages, const char *output);
+TIFFSNIP_API int tiffsnip_extract(struct Tiffsnip *snip, const char *pages, const char *output);
+TIFFSNIP_API int tiffsnip_verify(struct Tiffsnip *snip, FILE *report);
+// with options.stats, what the handle has cost so far, as text or with
+// options.json as one line of JSON, and with options.read_report the
+// device reads it took
+TIFFSNIP_API void tiffsnip_print_stats(struct Tiffsnip *snip, FILE *out);
+TIFFSNIP_API int tiffsnip_close(struct Tiffsnip *snip, char *error, size_t error_size);
+
+// open, act on and close one file as options say, as the command line does
+TIFFSNIP_API int tiffsnip_file(const char *path, const struct TiffsnipOptions *options, const char *output,
+                               struct TiffsnipRing *ring, FILE *report, char *error, size_t error_size);
+
+// NULL when the kernel has no io_uring, with errno saying why
+TIFFSNIP_API struct TiffsnipRing *tiffsnip_ring_create(void);
+// the writes, IOPS and bandwidth the ring has managed so far
+TIFFSNIP_API void tiffsnip_ring_print_stats(const struct TiffsnipRing *ring, FILE *out);
+TIFFSNIP_API void tiffsnip_ring_destroy(struct TiffsnipRing *ring);
+TIFFSNIP_API int tiffsnip_parse_predicate(const char *text, struct TiffsnipPredicate *predicate);
+TIFFSNIP_API void tiffsnip_print_json_string(FILE *out, const char *text);
+
+#endif
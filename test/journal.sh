@@ -0,0 +1,37 @@
+#!/bin/sh
+# Snip a file with --journal, restore it, then snip and restore it again:
+# each snip must get a journal of its own, each restore must give back the
+# original bytes and retire its journal.
+
+cd "$(dirname "$0")/.." || exit 1
+TIFFSNIP=${TIFFSNIP:-./tiffsnip}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT INT TERM
+mkdir "$dir/journals"
+
+fail(){
+    echo "journal: $*"
+    exit 1
+}
+
+bench/gentiff --size 1M --tiles 100 "$dir/x.tif" >/dev/null || fail "generating a file failed"
+cp "$dir/x.tif" "$dir/original.tif"
+for round in 1 2; do
+    "$TIFFSNIP" --journal "$dir/journals" "$dir/x.tif" 2 >/dev/null || fail "snip $round failed"
+    cmp -s "$dir/x.tif" "$dir/original.tif" && fail "snip $round changed nothing"
+    set -- "$dir"/journals/*.journal
+    [ $# -eq 1 ] && [ -f "$1" ] || fail "snip $round left $# journals"
+    "$TIFFSNIP" --restore "$1" >/dev/null || fail "restore $round failed"
+    cmp -s "$dir/x.tif" "$dir/original.tif" || fail "restore $round didn't give back the original"
+    [ -e "$1" ] && fail "restore $round left its journal behind"
+done
+
+# two snips in a row take numbered journals, restored newest first
+"$TIFFSNIP" --journal "$dir/journals" "$dir/x.tif" 3 >/dev/null || fail "first of two snips failed"
+"$TIFFSNIP" --journal "$dir/journals" "$dir/x.tif" 1 >/dev/null || fail "second of two snips failed"
+set -- "$dir"/journals/*-2.journal
+[ -f "$1" ] || fail "the second snip didn't take journal 2"
+"$TIFFSNIP" --restore "$1" >/dev/null && "$TIFFSNIP" --restore "$dir"/journals/*-1.journal >/dev/null ||
+    fail "restoring two journals failed"
+cmp -s "$dir/x.tif" "$dir/original.tif" || fail "restoring two journals didn't give back the original"
+echo "journal: ok"
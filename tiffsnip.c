@@ -12,394 +12,668 @@
  * GNU General Public License for more details.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
-#include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
-#include <sys/types.h>
-#include "tiff.h"
-
-bool DEBUG = false;
+#include <pthread.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "libtiffsnip.h"
 
-#define BUFFER_SIZE 2048
-char ZEROS[BUFFER_SIZE] = {0};
+static const bool DEBUG = false;
 
-struct Header {
-    uint16 byte_order;
-    uint16 magic_number;
-};
-
-struct BigHeader {
-    uint16 offset_bytesize;
-    uint16 zeros;
-};
+// the least working memory a file is given under --mem-limit
+#define MIN_FILE_MEMORY (4 * 1024 * 1024)
 
-struct IFD {
-    uint16 tag;
-    uint16 tag_type;
-    int32 count;
-    uint32 value;
-};
-
-struct __attribute__((__packed__)) BIGIFD {
-    uint16 tag;
-    uint16 tag_type;
-    uint64_t count;
-    uint64_t value;
+/*
+ * A batch is a list of files shared by a pool of workers. Each worker pulls
+ * the next file under the lock and snips it with its own handles.
+ */
+struct Batch {
+    char **files;
+    size_t file_count;
+    size_t next_file;
+    const struct TiffsnipOptions *options;
+    const char *output_dir;
+    int failures;
+    pthread_mutex_t lock;
 };
 
-int IFD_ROW_SIZE = sizeof(struct IFD);
-int OFFSET_SIZE = sizeof(uint32);
-int IFD_COUNT_SIZE = sizeof(int16);
-bool BIG_TIFF = false;
-
-int ifd_value_size(uint16 tag_type){
-    switch(tag_type){
-        case TIFF_NOTYPE:
-            return 0;      /* placeholder */
-            break;
-        case TIFF_BYTE:
-            return sizeof(uint8);        /* 8-bit unsigned integer */
-            break;
-        case TIFF_ASCII:
-            return sizeof(uint8);       /* 8-bit bytes w/ last byte null */
-            break;
-        case TIFF_SHORT:
-            return sizeof(uint16);     /* 16-bit unsigned integer */
-            break;
-        case TIFF_LONG:
-            return sizeof(uint32);
-            break;  /* 32-bit unsigned integer */
-        case TIFF_RATIONAL:
-            return sizeof(uint64_t); /* 64-bit unsigned fraction */
-            break;
-        case TIFF_SBYTE:
-            return sizeof(uint8);       /* !8-bit signed integer */
-            break;
-        case TIFF_UNDEFINED:
-            return sizeof(uint8);
-            break;   /* !8-bit untyped data */
-        case TIFF_SSHORT:
-            return sizeof(uint16);      /* !16-bit signed integer */
-            break;
-        case TIFF_SLONG:
-            return sizeof(uint32);      /* !32-bit signed integer */
-            break;
-        case TIFF_SRATIONAL:
-            return sizeof(uint64_t);  /* !64-bit signed fraction */
-            break;
-        case TIFF_FLOAT:
-            return sizeof(uint32);      /* !32-bit IEEE floating point */
-            break;
-        case TIFF_DOUBLE:
-            return sizeof(uint64_t);    /* !64-bit IEEE floating point */
-            break;
-        case TIFF_IFD:
-            return sizeof(uint32);
-            break;        /* %32-bit unsigned integer (offset) */
-        case TIFF_LONG8:
-            return sizeof(uint64_t);      /* BigTIFF 64-bit unsigned integer */
-            break;
-        case TIFF_SLONG8:
-            return sizeof(uint64_t);
-            break;     /* BigTIFF 64-bit signed integer */
-        case TIFF_IFD8:
-            return sizeof(uint64_t);
-            break;       /* BigTIFF 64-bit unsigned integer (offset) */
-    }
-    return 0;
+/*
+ * Set up an io_uring for a worker, saying so when the kernel won't give us
+ * one and the writes stay synchronous.
+ */
+static struct TiffsnipRing *worker_ring(const struct TiffsnipOptions *options){
+    if(!options->uring){
+        return NULL;
+    }
+    struct TiffsnipRing *ring = tiffsnip_ring_create();
+    if(ring == NULL){
+        fprintf(stderr, "io_uring is unavailable (%s), using synchronous writes.\n", strerror(errno));
+    }
+    return ring;
 }
 
-struct IFD* find_tag(struct IFD ifds[], int ifd_count, uint16 tag){
-    for(int i = 0; i < ifd_count; i++){
-        if(ifds[i].tag == tag){
-            return &ifds[i];
+static void print_status(const struct TiffsnipOptions *options, const char *path, int status, const char *error, const char *listing){
+    if((options->list || options->verify) && options->json){
+        if(status){
+            fputs("{\"file\":", stdout);
+            tiffsnip_print_json_string(stdout, path);
+            fputs(",\"error\":", stdout);
+            tiffsnip_print_json_string(stdout, error);
+            fputs("}\n", stdout);
+        } else {
+            fputs(listing, stdout);
         }
+    } else if(status){
+        printf("%s: error: %s\n", path, error);
+    } else if(options->list){
+        printf("%s:\n%s", path, listing);
+    } else if(options->verify){
+        printf("%s: %s", path, listing);
+    } else {
+        printf("%s: ok\n", path);
     }
-    return 0;
 }
 
-struct BIGIFD* find_big_tag(struct BIGIFD ifds[], int64_t ifd_count, uint16 tag){
-    for(int i = 0; i < ifd_count; i++){
-        if(ifds[i].tag == tag){
-            return &ifds[i];
-        }
-    }
-    return 0;
+static const char *base_name(const char *path){
+    const char *name = strrchr(path, '/');
+    return name ? name + 1 : path;
 }
 
-void tiff_clear(FILE *fp, off_t start, int64_t size){
-    if(DEBUG) printf("Clearing %lld at 0x%llx\n", size, start);
-    fseeko(fp, start, SEEK_SET);
-    int64_t remaining_size = size;
-    while(remaining_size > 0){
-        if(remaining_size > BUFFER_SIZE){
-            fwrite(ZEROS, sizeof(char), BUFFER_SIZE, fp);
-        } else {
-            fwrite(ZEROS, sizeof(char), remaining_size, fp);
+static void *batch_worker(void *arg){
+    struct Batch *batch = arg;
+    char error[256];
+    char output[4096];
+    struct TiffsnipRing *ring = worker_ring(batch->options);
+    for(;;){
+        pthread_mutex_lock(&batch->lock);
+        size_t index = batch->next_file++;
+        pthread_mutex_unlock(&batch->lock);
+        if(index >= batch->file_count){
+            if(ring){
+                pthread_mutex_lock(&batch->lock);
+                if(batch->options->stats){
+                    tiffsnip_ring_print_stats(ring, stderr);
+                }
+                tiffsnip_ring_destroy(ring);
+                pthread_mutex_unlock(&batch->lock);
+            }
+            return NULL;
+        }
+        const char *path = batch->files[index];
+        const char *target = NULL;
+        if(batch->output_dir && batch->options->split){
+            // pages are named after their file
+            target = batch->output_dir;
+        } else if(batch->output_dir){
+            snprintf(output, sizeof(output), "%s/%s", batch->output_dir, base_name(path));
+            target = output;
+        }
+        // listings are collected per file so they come out whole
+        char *listing = NULL;
+        size_t listing_size = 0;
+        FILE *report = open_memstream(&listing, &listing_size);
+        int status = tiffsnip_file(path, batch->options, target, ring, report, error, sizeof(error));
+        fclose(report);
+        pthread_mutex_lock(&batch->lock);
+        if(status){
+            batch->failures += 1;
         }
-        remaining_size -= BUFFER_SIZE;
+        print_status(batch->options, path, status, error, listing);
+        free(listing);
+        fflush(stdout);
+        pthread_mutex_unlock(&batch->lock);
     }
 }
 
-void overwrite_ifd_offset(FILE *fp, off_t offset, off_t final_offset){
-    fseeko(fp, offset, SEEK_SET);
-    int64_t ifd_count = 0;
-    fread(&ifd_count, IFD_COUNT_SIZE, 1, fp);
-    fseek(fp, IFD_ROW_SIZE * ifd_count, SEEK_CUR);
-    fwrite(&final_offset, OFFSET_SIZE, 1, fp);
+static int compare_base_names(const void *a, const void *b){
+    return strcmp(base_name(*(char * const *)a), base_name(*(char * const *)b));
 }
 
-off_t scan_ifd(FILE *fp, off_t offset, int page_num, bool delete){
-    fseeko(fp, offset, SEEK_SET);
-    int ifd_count;
-    fread(&ifd_count, IFD_COUNT_SIZE, 1, fp);
-    if(DEBUG) printf("Image #%d\n", page_num);
-    if(DEBUG) printf("Found %d IFDs\n", ifd_count);
-    bool tiles_found = false;
-    bool strips_found = false;
-    struct IFD ifds[ifd_count];
-    fread(&ifds, IFD_ROW_SIZE, ifd_count, fp);
-    for(int i = 0; i < ifd_count; i++){
-        if(DEBUG) printf("TAG: %d, Type: %d, Count: %d, Value: %d\n",
-               ifds[i].tag,
-               ifds[i].tag_type,
-               ifds[i].count,
-               ifds[i].value);
-        if(ifds[i].tag == TIFFTAG_STRIPOFFSETS){
-            strips_found = true;
-        }
-        if(ifds[i].tag == TIFFTAG_TILEOFFSETS){
-            tiles_found = true;
+/*
+ * Outputs are named after their file, so two files of the same name would
+ * be written to the same place. Return one such name, or NULL.
+ */
+static const char *duplicate_name(char **files, size_t file_count){
+    char **sorted = malloc(file_count * sizeof(char *));
+    memcpy(sorted, files, file_count * sizeof(char *));
+    qsort(sorted, file_count, sizeof(char *), compare_base_names);
+    const char *duplicate = NULL;
+    for(size_t i = 1; i < file_count && duplicate == NULL; i++){
+        if(compare_base_names(&sorted[i - 1], &sorted[i]) == 0){
+            duplicate = base_name(sorted[i]);
         }
     }
-    off_t next_offset = 0;
-    fread(&next_offset, OFFSET_SIZE, 1, fp);
-    if(DEBUG) printf("Next Offset: 0x%llx\n", next_offset);
-    if(delete){
-        if(DEBUG) printf("Deleting IFD table\n");
-        int64_t ifd_size = (IFD_ROW_SIZE * ifd_count) + IFD_COUNT_SIZE + OFFSET_SIZE;
-        tiff_clear(fp, offset, ifd_size);
-        if(tiles_found || strips_found){
-            uint16 size_tag;
-            uint16 offset_tag;
-            if(tiles_found){
-                offset_tag = TIFFTAG_TILEOFFSETS;
-                size_tag = TIFFTAG_TILEBYTECOUNTS;
-            } else {
-                offset_tag = TIFFTAG_STRIPOFFSETS;
-                size_tag = TIFFTAG_STRIPBYTECOUNTS;
-            }
-            struct IFD *size_row;
-            struct IFD *offset_row;
-            size_row = find_tag(ifds, ifd_count, size_tag);
-            if(DEBUG) printf("Found this many tilesizes: %d\n", size_row->count);
-            offset_row = find_tag(ifds, ifd_count, offset_tag);
+    free(sorted);
+    return duplicate;
+}
 
-            if(size_row->count != offset_row->count){
-                printf("Bad Tile offset/size row found, exiting.\n");
-                return 1;
-            }
+struct FileId {
+    dev_t dev;
+    ino_t ino;
+    size_t index;
+};
 
-            //then iterate through offsets
-            fseek(fp, offset_row->value, SEEK_SET);
-            uint32 tile_addresses[offset_row->count];
-            fread(&tile_addresses, OFFSET_SIZE, offset_row->count, fp);
+static int compare_file_ids(const void *a, const void *b){
+    const struct FileId *x = a;
+    const struct FileId *y = b;
+    if(x->dev != y->dev){
+        return x->dev < y->dev ? -1 : 1;
+    }
+    if(x->ino != y->ino){
+        return x->ino < y->ino ? -1 : 1;
+    }
+    return x->index < y->index ? -1 : x->index > y->index;
+}
 
-            fseek(fp, size_row->value, SEEK_SET);
-            uint32 tile_sizes[size_row->count];
-            fread(&tile_sizes, OFFSET_SIZE, size_row->count, fp);
-            // in the special case where a single tile/strip exists
-            // we need to delete the offset from the value/offset field
-            if(offset_row->count == 1){
-              tiff_clear(fp, offset_row->value, size_row->value);
-            } else {
-              for(int i = 0; i < offset_row->count; i++){
-                  tiff_clear(fp, tile_addresses[i], tile_sizes[i]);
-              }
-            }
+/*
+ * Drop every file that is the same file as one before it, however it was
+ * named, so none is snipped in place twice, perhaps by two workers at once.
+ * Files that can't be looked at are kept to fail on their own. Returns how
+ * many are left.
+ */
+static size_t drop_duplicate_files(char **files, size_t file_count){
+    struct FileId *ids = malloc(file_count * sizeof(struct FileId));
+    bool *dropped = calloc(file_count, sizeof(bool));
+    if(ids == NULL || dropped == NULL){
+        free(ids);
+        free(dropped);
+        return file_count;
+    }
+    size_t id_count = 0;
+    for(size_t i = 0; i < file_count; i++){
+        struct stat st;
+        if(stat(files[i], &st) == 0){
+            ids[id_count++] = (struct FileId){st.st_dev, st.st_ino, i};
+        }
+    }
+    qsort(ids, id_count, sizeof(struct FileId), compare_file_ids);
+    // within a file the first naming of it sorts first and is kept
+    for(size_t i = 1, first = 0; i < id_count; i++){
+        if(ids[i].dev == ids[first].dev && ids[i].ino == ids[first].ino){
+            dropped[ids[i].index] = true;
+            printf("%s is the same file as %s, snipping it once\n", files[ids[i].index], files[ids[first].index]);
+        } else {
+            first = i;
         }
+    }
+    size_t kept = 0;
+    for(size_t i = 0; i < file_count; i++){
+        if(!dropped[i]){
+            files[kept++] = files[i];
+        }
+    }
+    free(ids);
+    free(dropped);
+    return kept;
+}
 
-        // delete all off stored information
-        for(int i = 0; i < ifd_count; i++){
-            // TODO: change to something with size
-            if(ifd_value_size(ifds[i].tag_type) * ifds[i].count > sizeof(uint32)){
-                tiff_clear(fp, ifds[i].value, ifds[i].count * ifd_value_size(ifds[i].tag_type));
-            }
+static int run_batch(char **files, size_t file_count, const struct TiffsnipOptions *options, const char *output_dir, int jobs){
+    const char *duplicate = output_dir ? duplicate_name(files, file_count) : NULL;
+    if(duplicate){
+        printf("More than one file is named %s, so their outputs would collide, exiting.\n", duplicate);
+        return 1;
+    }
+    // files snipped in place are each snipped once
+    bool in_place = (options->page_spec || options->predicate_count || options->hoist) && output_dir == NULL &&
+                    options->plan == NULL && !options->list && !options->apply && !options->restore;
+    if(in_place){
+        file_count = drop_duplicate_files(files, file_count);
+    }
+    // the memory limit covers the whole batch, so it is shared out between
+    // the workers, running fewer of them when each would get too little
+    struct TiffsnipOptions shared = *options;
+    struct Batch batch = {files, file_count, 0, &shared, output_dir, 0, PTHREAD_MUTEX_INITIALIZER};
+    if(shared.mem_limit && (size_t)jobs > shared.mem_limit / MIN_FILE_MEMORY){
+        jobs = shared.mem_limit / MIN_FILE_MEMORY;
+    }
+    if(jobs < 1){
+        jobs = 1;
+    }
+    if((size_t)jobs > file_count){
+        jobs = file_count ? file_count : 1;
+    }
+    shared.mem_limit /= jobs;
+    if(DEBUG && shared.mem_limit) printf("%d workers with %zu bytes each\n", jobs, shared.mem_limit);
+    pthread_t workers[jobs];
+    int started = 0;
+    for(int i = 0; i < jobs; i++){
+        if(pthread_create(&workers[started], NULL, batch_worker, &batch) == 0){
+            started += 1;
         }
     }
-    return next_offset;
+    if(started == 0){
+        batch_worker(&batch);
+    }
+    for(int i = 0; i < started; i++){
+        pthread_join(workers[i], NULL);
+    }
+    if(DEBUG) printf("%zu files, %d failed\n", file_count, batch.failures);
+    return batch.failures ? 1 : 0;
 }
 
-off_t scan_big_ifd(FILE *fp, off_t offset, int page_num, bool delete){
-    fseeko(fp, offset, SEEK_SET);
-    int64_t ifd_count = 0;
-    fread(&ifd_count, IFD_COUNT_SIZE, 1, fp);
-    if(DEBUG) printf("Image #%d\n", page_num);
-    if(DEBUG) printf("Found %lld IFDs\n", ifd_count);
-    bool tiles_found = false;
-    bool strips_found = false;
-    struct BIGIFD ifds[ifd_count];
-    fread(&ifds, IFD_ROW_SIZE, ifd_count, fp);
-    for(int i = 0; i < ifd_count; i++){
-        if(DEBUG) printf("TAG: %d, Type: %d, Count: %lld, Value: %lld\n",
-               ifds[i].tag,
-               ifds[i].tag_type,
-               ifds[i].count,
-               ifds[i].value);
-        if(ifds[i].tag == TIFFTAG_STRIPOFFSETS){
-            strips_found = true;
+/*
+ * Snip or list the tiff on stdin, writing what is left to stdout, so every
+ * message goes to stderr.
+ */
+static int snip_stream(const struct TiffsnipOptions *options){
+    char error[256];
+    struct Tiffsnip *snip = tiffsnip_open_stream(stdin, stdout, options);
+    int status = tiffsnip_page_count(snip) < 0;
+    if(status == 0){
+        status = options->list ? tiffsnip_list(snip, stdout) : tiffsnip_delete(snip, NULL, NULL);
+    }
+    if(status){
+        fprintf(stderr, "%s, exiting.\n", tiffsnip_error(snip));
+    }
+    tiffsnip_print_stats(snip, stderr);
+    if(tiffsnip_close(snip, status ? NULL : error, sizeof(error)) && status == 0){
+        fprintf(stderr, "%s, exiting.\n", error);
+        status = 1;
+    }
+    return status;
+}
+
+/*
+ * Read a manifest of file names, one per line, from path or stdin for "-".
+ */
+static char **read_manifest(const char *path, char **files, size_t *file_count){
+    FILE *fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if(fp == NULL){
+        return NULL;
+    }
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t length;
+    while((length = getline(&line, &line_size, fp)) != -1){
+        while(length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')){
+            line[--length] = '\0';
         }
-        if(ifds[i].tag == TIFFTAG_TILEOFFSETS){
-            tiles_found = true;
+        if(length == 0){
+            continue;
         }
+        files = realloc(files, (*file_count + 1) * sizeof(char *));
+        files[(*file_count)++] = strdup(line);
     }
-    off_t next_offset = 0;
-    fread(&next_offset, OFFSET_SIZE, 1, fp);
-    if(DEBUG) printf("Next Offset: 0x%llx\n", next_offset);
-    if(delete){
-        if(DEBUG) printf("Deleting IFD table\n");
-        int64_t ifd_size = (IFD_ROW_SIZE * ifd_count) + IFD_COUNT_SIZE + OFFSET_SIZE;
-        tiff_clear(fp, offset, ifd_size);
-        if(tiles_found || strips_found){
-            uint16 size_tag;
-            uint16 offset_tag;
-            if(tiles_found){
-                offset_tag = TIFFTAG_TILEOFFSETS;
-                size_tag = TIFFTAG_TILEBYTECOUNTS;
-            } else {
-                offset_tag = TIFFTAG_STRIPOFFSETS;
-                size_tag = TIFFTAG_STRIPBYTECOUNTS;
-            }
-            struct BIGIFD *size_row;
-            struct BIGIFD *offset_row;
-            size_row = find_big_tag(ifds, ifd_count, size_tag);
-            if(DEBUG) printf("Found this many tilesizes: %lld\n", size_row->count);
-            offset_row = find_big_tag(ifds, ifd_count, offset_tag);
-
-            if(size_row->count != offset_row->count){
-                printf("Bad Tile offset/size row found, exiting.\n");
-                return 1;
-            }
+    free(line);
+    if(fp != stdin){
+        fclose(fp);
+    }
+    return files ? files : calloc(1, sizeof(char *));
+}
 
-            //then iterate through offsets
-            fseek(fp, offset_row->value, SEEK_SET);
-            uint64_t tile_addresses[offset_row->count];
-            fread(&tile_addresses, OFFSET_SIZE, offset_row->count, fp);
+/*
+ * Parse a byte count with an optional K, M or G suffix.
+ */
+static bool parse_size(const char *text, size_t *size){
+    char *end;
+    unsigned long long value = strtoull(text, &end, 10);
+    if(end == text){
+        return false;
+    }
+    switch(*end){
+        case 'k':
+        case 'K':
+            value <<= 10;
+            end++;
+            break;
+        case 'm':
+        case 'M':
+            value <<= 20;
+            end++;
+            break;
+        case 'g':
+        case 'G':
+            value <<= 30;
+            end++;
+            break;
+    }
+    *size = value;
+    return *end == '\0' && value > 0;
+}
 
-            fseek(fp, size_row->value, SEEK_SET);
-            uint64_t tile_sizes[size_row->count];
-            fread(&tile_sizes, OFFSET_SIZE, size_row->count, fp);
+static void usage(void){
+    printf("tiffsnip, version 1.0\nA utility for zeroing pages from tiff files\n\n"
+           "Usage: tiffsnip [options] file pages\n"
+           "       tiffsnip [options] -p pages file...\n"
+           "       tiffsnip [options] -w test file...\n"
+           "       tiffsnip --list [--json] file...\n"
+           "       tiffsnip --verify [--json] file...\n"
+           "       tiffsnip --apply plan...\n"
+           "       tiffsnip --restore journal...\n"
+           "       tiffsnip --stream [options] < file > snipped\n"
+           "\tfile: the tiff file to be snipped\n"
+           "\tpages: the pages to be snipped (1 indexed), as a list or ranges\n"
+           "\t       such as 2,4-6,-1 where negative numbers count from the last page\n\n"
+           "Options:\n"
+           "\t-p, --pages pages: snip the same pages from every file given\n"
+           "\t-w, --where test: snip pages whose tags pass the test, which is a field\n"
+           "\t                  (description, subfile, width, height, compression,\n"
+           "\t                  tiles or bytes), an operator (~ contains, = != < <= > >=\n"
+           "\t                  or & any bits set) and a value, e.g. description~label\n"
+           "\t                  or subfile&1; repeat for pages passing any of them\n"
+           "\t-l, --list: print each page's geometry, compression, subfile type,\n"
+           "\t            description and tile count instead of snipping\n"
+           "\t--json: with --list or --verify, print one JSON object per file\n"
+           "\t--verify: check that the IFD chain is intact, that no page references\n"
+           "\t          cleared bytes and that cleared bytes read as zero; after\n"
+           "\t          snipping with -p or -w, or on its own, where every byte no\n"
+           "\t          page references counts as cleared\n"
+           "\t--files-from list: also snip the files named in list, one per line,\n"
+           "\t                   or read from stdin when list is -\n"
+           "\t-j, --jobs n: number of files to snip at once (default: cpu count)\n"
+           "\t--mem-limit size: cap the working memory of the whole run, such as\n"
+           "\t                  64M; gathered ranges are cleared early to stay\n"
+           "\t                  within it and fewer files are snipped at once\n"
+           "\t--stdio: use buffered stdio instead of memory mapping the file\n"
+           "\t--read-block size: don't map the file, read IFDs and tables through\n"
+           "\t                   a cache of blocks starting at size (default: 64K)\n"
+           "\t                   that grow while reads run forward, and report\n"
+           "\t                   the device reads each file took\n"
+           "\t--stream: read the tiff from stdin and write it to stdout with the\n"
+           "\t          pages given by -p or -w snipped, laid out as it was;\n"
+           "\t          the input is spooled to $TMPDIR until every IFD and\n"
+           "\t          array has been read and then passes straight through\n"
+           "\t--spool size: the most of a --stream input to spool (default:\n"
+           "\t              256M), failing if its IFDs lie further in\n"
+           "\t--stats: report on stderr the time each phase of the work took, the\n"
+           "\t         bytes read and written, system calls and seeks made, and\n"
+           "\t         the ranges cleared by size; one JSON line with --json\n"
+           "\t--punch: punch holes over removed data instead of writing zeros\n"
+           "\t--overwrite policy: what removed data is overwritten with: zero\n"
+           "\t                    (the default), random, or a number of random\n"
+           "\t                    passes, each flushed to disk before the next\n"
+           "\t--final-zero: with --overwrite random or n, finish with a pass of\n"
+           "\t              zeros, or holes with --punch\n"
+           "\t--uring: queue clearing and relinking writes on an io_uring, and\n"
+           "\t         with --stats report the IOPS and bandwidth achieved\n"
+           "\t--plan plan: write what snipping would do to plan, or - for stdout,\n"
+           "\t             and leave the file untouched\n"
+           "\t--apply: carry out the plans given instead of files, refusing any\n"
+           "\t         whose file has changed since the plan was made\n"
+           "\t--atomic: append a new IFD chain for the remaining pages and switch\n"
+           "\t          the header to it before clearing anything, so a crash\n"
+           "\t          never leaves a broken file; the file grows by the IFDs\n"
+           "\t--journal dir: record every byte overwritten in a new journal,\n"
+           "\t               dir/<file>-<device>-<inode>-<n>.journal\n"
+           "\t--restore: replay the journals given instead of files, putting\n"
+           "\t           back what was cleared and relinked, and remove them;\n"
+           "\t           restore a file's journals one at a time, highest n first\n"
+           "\t--extract out: leave file untouched and write the selected pages\n"
+           "\t               to a new file; a directory when snipping several\n"
+           "\t--split: with --extract, write each selected page, or every page\n"
+           "\t         when none are selected, to out/<file>-<page>, in parallel\n"
+           "\t--hoist: with --output or --extract, put every IFD and its tag\n"
+           "\t         values in one block after the header, ahead of the data;\n"
+           "\t         with no pages selected the whole file is rewritten\n"
+           "\t-o, --output out: leave file untouched and write the remaining pages\n"
+           "\t                  to a new, compacted file; a directory when snipping\n"
+           "\t                  several files\n"
+           "\t--help: show this message\n\n"
+           "Options must come before the file.\n");
+}
 
-            // in the special case where a single tile/strip exists
-            // we need to delete the offset from the value/offset field
-            if(offset_row->count == 1){
-              tiff_clear(fp, offset_row->value, size_row->value);
-            } else {
-              for(int i = 0; i < offset_row->count; i++){
-                  tiff_clear(fp, tile_addresses[i], tile_sizes[i]);
-              }
-            }
+int main(int argc, char *argv[]) {
+    // notices and reports stay off stdout, which carries listings and JSON
+    struct TiffsnipOptions options = {.use_mmap = true, .log = stderr};
+    bool stream = false;
+    const char *output = NULL;
+    const char *manifest = NULL;
+    int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    static struct option long_options[] = {
+        {"help", no_argument, NULL, 'h'},
+        {"stdio", no_argument, NULL, 's'},
+        {"punch", no_argument, NULL, 'P'},
+        {"overwrite", required_argument, NULL, 'O'},
+        {"final-zero", no_argument, NULL, 'Z'},
+        {"uring", no_argument, NULL, 'u'},
+        {"list", no_argument, NULL, 'l'},
+        {"json", no_argument, NULL, 'J'},
+        {"verify", no_argument, NULL, 'V'},
+        {"plan", required_argument, NULL, 'n'},
+        {"apply", no_argument, NULL, 'A'},
+        {"atomic", no_argument, NULL, 'a'},
+        {"journal", required_argument, NULL, 'U'},
+        {"restore", no_argument, NULL, 'R'},
+        {"extract", required_argument, NULL, 'x'},
+        {"split", no_argument, NULL, 'S'},
+        {"hoist", no_argument, NULL, 'H'},
+        {"read-block", required_argument, NULL, 'B'},
+        {"stats", no_argument, NULL, 'T'},
+        {"stream", no_argument, NULL, 'I'},
+        {"spool", required_argument, NULL, 'L'},
+        {"where", required_argument, NULL, 'w'},
+        {"output", required_argument, NULL, 'o'},
+        {"pages", required_argument, NULL, 'p'},
+        {"files-from", required_argument, NULL, 'f'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"mem-limit", required_argument, NULL, 'M'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while((opt = getopt_long(argc, argv, "+hlo:p:j:w:", long_options, NULL)) != -1){
+        switch(opt){
+            case 's':
+                options.use_mmap = false;
+                break;
+            case 'P':
+                options.punch = true;
+                break;
+            case 'O':
+                if(strcmp(optarg, "zero") == 0){
+                    options.random_passes = 0;
+                } else if(strcmp(optarg, "random") == 0){
+                    options.random_passes = 1;
+                } else {
+                    char *end;
+                    long passes = strtol(optarg, &end, 10);
+                    if(*end || passes < 1 || passes > 100){
+                        printf("Bad overwrite policy '%s', expected zero, random or a number of passes\n", optarg);
+                        return 1;
+                    }
+                    options.random_passes = passes;
+                }
+                break;
+            case 'Z':
+                options.final_zero = true;
+                break;
+            case 'u':
+                options.uring = true;
+                break;
+            case 'l':
+                options.list = true;
+                break;
+            case 'J':
+                options.json = true;
+                break;
+            case 'V':
+                options.verify = true;
+                break;
+            case 'n':
+                options.plan = optarg;
+                break;
+            case 'A':
+                options.apply = true;
+                break;
+            case 'a':
+                options.atomic = true;
+                break;
+            case 'U':
+                options.journal = optarg;
+                break;
+            case 'R':
+                options.restore = true;
+                break;
+            case 'x':
+                output = optarg;
+                options.extract = true;
+                break;
+            case 'S':
+                options.split = true;
+                break;
+            case 'H':
+                options.hoist = true;
+                break;
+            case 'B':
+                if(!parse_size(optarg, &options.read_block) || options.read_block < 512 ||
+                   options.read_block > TIFFSNIP_MAX_READ_BLOCK){
+                    printf("Bad read block size '%s'\n", optarg);
+                    return 1;
+                }
+                options.use_mmap = false;
+                options.read_report = true;
+                break;
+            case 'T':
+                options.stats = true;
+                break;
+            case 'I':
+                stream = true;
+                break;
+            case 'L':
+                if(!parse_size(optarg, &options.spool_limit)){
+                    printf("Bad spool size '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'w':
+                options.predicates = realloc(options.predicates, (options.predicate_count + 1) * sizeof(struct TiffsnipPredicate));
+                if(tiffsnip_parse_predicate(optarg, &options.predicates[options.predicate_count])){
+                    printf("Bad predicate '%s'\n", optarg);
+                    return 1;
+                }
+                options.predicate_count += 1;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'p':
+                options.page_spec = optarg;
+                break;
+            case 'f':
+                manifest = optarg;
+                break;
+            case 'j':
+                jobs = atoi(optarg);
+                break;
+            case 'M':
+                if(!parse_size(optarg, &options.mem_limit)){
+                    printf("Bad memory limit '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'h':
+            default:
+                usage();
+                return opt == 'h' ? 0 : 1;
         }
+    }
 
-        // delete all off stored information
-        for(int i = 0; i < ifd_count; i++){
-            // TODO: change to something with size
-            if(ifd_value_size(ifds[i].tag_type) * ifds[i].count > sizeof(uint64_t)){
-                tiff_clear(fp, ifds[i].value, ifds[i].count * ifd_value_size(ifds[i].tag_type));
-            }
+    char **files = argv + optind;
+    size_t file_count = argc - optind;
+    if(options.split && (!options.extract || options.verify)){
+        printf("--split goes with --extract and can't be combined with --verify\n");
+        return 1;
+    }
+    if(options.extract && (options.list || options.apply || options.restore)){
+        printf("--extract can't be combined with --list, --apply or --restore\n");
+        return 1;
+    }
+    if(options.split && options.page_spec == NULL && options.predicate_count == 0){
+        // every page
+        options.page_spec = "1--1";
+    }
+    if(options.hoist && output == NULL){
+        printf("--hoist rewrites the file, so it needs --output or --extract\n");
+        return 1;
+    }
+    if(options.final_zero && options.random_passes == 0){
+        printf("--final-zero goes with --overwrite random or a number of passes\n");
+        return 1;
+    }
+    if(options.random_passes && (output || options.list || options.restore ||
+                                 (options.verify && !options.final_zero))){
+        // without the zeros, what --verify finds cleared isn't zero
+        printf("--overwrite random only applies when snipping in place or applying a plan,\n"
+               "and needs --final-zero to be verified\n");
+        return 1;
+    }
+    if(stream){
+        if(options.random_passes){
+            fprintf(stderr, "--stream writes a new file, so there is nothing to --overwrite\n");
+            return 1;
+        }
+        if(file_count || manifest || output || options.verify || options.apply || options.restore || options.plan ||
+           options.atomic || options.journal || options.hoist || (options.page_spec == NULL &&
+           options.predicate_count == 0 && !options.list)){
+            fprintf(stderr, "--stream takes no files, goes with -p, -w or --list and can't be combined with\n"
+                            "--output, --extract, --verify, --plan, --apply, --restore, --atomic, --journal or --hoist\n");
+            return 1;
         }
+        return snip_stream(&options);
     }
-    return next_offset;
-}
-
-int main(int argc, char *argv[]) {
-    bool help = false;
-    help = argc != 3;
-    for(int i = 0; i < argc; i++){
-      if(strcmp(argv[i], "--help") == 0){
-        help = true;
-      }
-    }
-    if(help){
-      printf("tiffsnip, version 1.0\nA utility for zeroing pages from tiff files\n\nUsage: tiffsnip file page_index\n\tfile: the tiff file to be snipped\n\tpage_index: the page number to be snipped (1 indexed)\n");
-      return 0;
-    }
-    FILE *fp;
-    fp = fopen(argv[1], "r+b");
-    if(fp == NULL){
-        printf("Opening file failed\n");
+    if(options.page_spec == NULL && options.predicate_count == 0 && !options.list && !options.verify && !options.apply &&
+       !options.restore && !options.hoist){
+        // the original form, tiffsnip file pages
+        if(file_count != 2 || manifest){
+            usage();
+            return 1;
+        }
+        options.page_spec = argv[optind + 1];
+        file_count = 1;
+    }
+    if(manifest){
+        char **listed = calloc(file_count, sizeof(char *));
+        if(file_count){
+            memcpy(listed, files, file_count * sizeof(char *));
+        }
+        files = read_manifest(manifest, listed, &file_count);
+        if(files == NULL){
+            printf("Reading file list %s failed\n", manifest);
+            return 1;
+        }
+    }
+    if(file_count == 0){
+        usage();
         return 1;
     }
-    struct Header header;
-    fread(&header, sizeof(struct Header), 1, fp);
-
-    off_t first_offset = 0;
-    if (header.byte_order != TIFF_LITTLEENDIAN){
-        printf("Non-little endian byte order found, exiting.");
+    if(options.plan && (file_count != 1 || manifest || output || options.list || options.apply || options.verify)){
+        printf("--plan takes a single file and can't be combined with --output, --list, --apply or --verify\n");
         return 1;
     }
-    if (header.magic_number == TIFF_VERSION_BIG){
-        struct BigHeader big_header;
-        fread(&big_header, sizeof(struct BigHeader), 1, fp);
-        IFD_ROW_SIZE = 20;
-        OFFSET_SIZE = sizeof(uint64_t);
-        IFD_COUNT_SIZE = sizeof(uint64_t);
-        BIG_TIFF = true;
-    }
-    fread(&first_offset, OFFSET_SIZE, 1, fp);
-    if(DEBUG) printf("BO: %x\nMN: %d\nOffset: 0x%llx\n", header.byte_order,
-           header.magic_number,
-           first_offset);
-    if(DEBUG) printf("Offsetsize %d\n", OFFSET_SIZE);
-    off_t next_offset = first_offset;
-    off_t last_offset = 0;
-    int page_count = 0;
-    int to_delete = -1;
-    if(argc == 3){
-        to_delete = atoi(argv[2]);
-    }
-    while (next_offset > 0) {
-        page_count += 1;
-        last_offset = next_offset;
-        if(BIG_TIFF){
-            next_offset = scan_big_ifd(fp, next_offset, page_count, page_count == to_delete);
-        } else {
-            next_offset = scan_ifd(fp, next_offset, page_count, page_count == to_delete);
+    if(options.atomic && (output || options.plan || options.apply || options.list || options.restore)){
+        printf("--atomic only applies when snipping in place\n");
+        return 1;
+    }
+    if(options.journal && (output || options.plan || options.list || options.restore)){
+        printf("--journal only applies when snipping in place or applying a plan\n");
+        return 1;
+    }
+    if(options.restore && (options.verify || options.apply)){
+        printf("--restore can't be combined with --verify or --apply\n");
+        return 1;
+    }
+    if(file_count == 1 && manifest == NULL){
+        char error[256];
+        struct TiffsnipRing *ring = worker_ring(&options);
+        int status = tiffsnip_file(files[0], &options, output, ring, stdout, error, sizeof(error));
+        if(ring && options.stats){
+            tiffsnip_ring_print_stats(ring, stderr);
         }
-        if(page_count == to_delete){
-            if(DEBUG) printf("Updating last offset to next offset\n");
-            if(to_delete == 1){
-                // need to update offset from first header
-                if(DEBUG) printf("Overwriting Header Offset: 0x%llx\n", next_offset);
-                fseek(fp, sizeof(struct Header), SEEK_SET);
-                if(BIG_TIFF){
-                    fseek(fp, sizeof(struct BigHeader), SEEK_CUR);
-                }
-                fwrite(&next_offset, OFFSET_SIZE, 1, fp);
-                fclose(fp);
-                return 0;
-            } else {
-                // need to scan to correct offset
-                off_t final_offset = next_offset;
-                next_offset = first_offset;
-                page_count = 1;
-                while (page_count < to_delete - 1){
-                    if(BIG_TIFF){
-                        next_offset = scan_big_ifd(fp, next_offset, page_count, false);
-                    } else {
-                        next_offset = scan_ifd(fp, next_offset, page_count, false);
-                    }
-                    page_count += 1;
-                }
-                if(DEBUG) printf("Overwriting IFD Offset: 0x%llx -> 0x%llx\n", next_offset, final_offset);
-                overwrite_ifd_offset(fp, next_offset, final_offset);
-                fclose(fp);
-                return 0;
-            }
-            return 0;
+        if(ring){
+            tiffsnip_ring_destroy(ring);
+        }
+        if(status && (options.list || options.verify) && options.json){
+            print_status(&options, files[0], status, error, NULL);
+        } else if(status){
+            printf("%s, exiting.\n", error);
         }
+        return status;
     }
-    return 0;
+    return run_batch(files, file_count, &options, output, jobs);
 }